@@ -1,10 +1,75 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 namespace calcprime {
 
-std::vector<std::uint32_t>simple_sieve(std::uint64_t limit);
+// Odd primes up to a limit of at most 2^32, stored as halved gaps between
+// consecutive primes, one byte each: no prime gap below 2^32 exceeds 336.
+// Each chunk starts from an explicit prime, so a reader can start at any
+// index and several threads can stream disjoint parts of the table. Chunks
+// point into storage the table shares: generated buffers or a mapped file.
+class BasePrimes {
+public:
+    struct Chunk {
+        std::size_t first_index=0;
+        std::uint32_t first_prime=0;
+        const std::uint8_t*half_gaps=nullptr;
+        std::size_t gap_count=0;
+    };
+
+    class Reader {
+    public:
+        // Next prime in ascending order, or 0 past the end.
+        std::uint32_t next() {
+            if(pos_!=end_) {
+                value_+=2u*static_cast<std::uint32_t>(*pos_++);
+                return value_;
+            }
+            return next_chunk();
+        }
+
+    private:
+        friend class BasePrimes;
+        std::uint32_t next_chunk();
+
+        const std::vector<Chunk>*chunks_=nullptr;
+        std::size_t chunk_=0;
+        const std::uint8_t*pos_=nullptr;
+        const std::uint8_t*end_=nullptr;
+        std::uint32_t value_=0;
+    };
+
+    BasePrimes()=default;
+    BasePrimes(std::uint64_t limit,std::vector<Chunk>chunks,std::shared_ptr<const void>storage);
+
+    std::uint64_t limit() const { return limit_;}
+    // Number of odd primes; 2 is implied whenever limit()>=2.
+    std::size_t size() const { return size_;}
+    // A reader whose first next() returns the odd prime at index.
+    Reader reader(std::size_t index=0) const;
+    // Index of the first odd prime >=value, size() when there is none.
+    std::size_t lower_bound(std::uint64_t value) const;
+    // Every prime up to limit(), 2 included.
+    std::vector<std::uint32_t>to_vector() const;
+    const std::vector<Chunk>&chunks() const { return chunks_;}
+    // The primes up to a smaller limit, sharing this table's storage.
+    BasePrimes prefix(std::uint64_t limit) const;
+
+private:
+    std::uint64_t limit_=0;
+    std::size_t size_=0;
+    std::vector<Chunk>chunks_;
+    std::shared_ptr<const void>storage_;
+};
+
+// Segmented generation on the same wheel, marker and work queue as the main
+// sieve, split across threads (0 picks the machine's thread count).
+BasePrimes generate_base_primes(std::uint64_t limit,unsigned threads=1);
+
+std::vector<std::uint32_t>simple_sieve(std::uint64_t limit,unsigned threads=1);
 
 }
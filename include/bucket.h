@@ -1,34 +1,55 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 namespace calcprime {
 
-struct LargePrimeState;
-
+// A pending hit of a large sieving prime: the prime's index in the marker's
+// large-prime table and its position inside the target segment, packed with
+// the wheel index of the multiplier as (offset<<3)|wheel_index.
 struct BucketEntry {
-    std::uint32_t prime;
-    std::uint64_t next_index;
-    std::uint64_t offset;
-    std::uint64_t value;
-    LargePrimeState*owner;
+    std::uint32_t prime_index;
+    std::uint32_t offset_wheel;
+};
+
+inline constexpr unsigned kBucketWheelBits=3;
+inline constexpr std::uint32_t kBucketMaxOffset=(1u<<(32-kBucketWheelBits))-1;
+
+inline BucketEntry make_bucket_entry(std::uint32_t prime_index,std::uint32_t offset,std::uint32_t wheel_index) {
+    return BucketEntry{prime_index,(offset<<kBucketWheelBits)|wheel_index};
+}
+
+struct BucketBlock {
+    static constexpr std::size_t kEntries=1022;
+
+    BucketBlock*next;
+    std::uint32_t count;
+    BucketEntry entries[kEntries];
 };
 
+// Ring of per-segment bucket lists. Blocks come from a per-ring free list
+// and go back to it after their segment has been processed, so a running
+// sieve does not allocate.
 class BucketRing {
 public:
     BucketRing();
-    void reset(std::uint64_t start_segment);
+    void reset(std::uint64_t start_segment,std::size_t max_distance);
     void push(std::uint64_t segment,BucketEntry entry);
-    std::vector<BucketEntry>take(std::uint64_t segment);
+    BucketBlock*take(std::uint64_t segment);
+    void release(BucketBlock*blocks);
+    std::uint64_t base_segment() const { return base_segment_;}
 
 private:
-    void ensure_capacity(std::uint64_t segment);
-    void rehash(std::size_t new_size);
+    BucketBlock*allocate();
 
     std::uint64_t base_segment_;
     std::size_t mask_;
-    std::vector<std::vector<BucketEntry>>buckets_;
+    std::vector<BucketBlock*>heads_;
+    BucketBlock*free_;
+    std::vector<std::unique_ptr<BucketBlock[]>>chunks_;
 };
 
 }
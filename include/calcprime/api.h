@@ -22,6 +22,25 @@ typedef struct calcprime_cpu_info {
     int has_smt;
 } calcprime_cpu_info;
 
+typedef enum calcprime_sieve_layout {
+    CALCPRIME_LAYOUT_ODD_BITS=0,
+    CALCPRIME_LAYOUT_MOD30_BYTES=1
+} calcprime_sieve_layout;
+
+typedef enum calcprime_hybrid_mode {
+    CALCPRIME_HYBRID_AUTO=0,
+    CALCPRIME_HYBRID_OFF=1,
+    CALCPRIME_HYBRID_ON=2
+} calcprime_hybrid_mode;
+
+// How calcprime_run_range counts when no primes are delivered: AUTO picks
+// the segmented sieve or two Deleglise-Rivat evaluations by a cost model.
+typedef enum calcprime_count_method {
+    CALCPRIME_COUNT_AUTO=0,
+    CALCPRIME_COUNT_SIEVE=1,
+    CALCPRIME_COUNT_ANALYTIC=2
+} calcprime_count_method;
+
 typedef struct calcprime_segment_config {
     std::size_t segment_bytes;
     std::size_t tile_bytes;
@@ -29,6 +48,7 @@ typedef struct calcprime_segment_config {
     std::size_t tile_bits;
     std::uint64_t segment_span;
     std::uint64_t tile_span;
+    calcprime_sieve_layout layout;
 } calcprime_segment_config;
 
 typedef enum calcprime_status {
@@ -65,6 +85,8 @@ typedef struct calcprime_range_options {
     calcprime_wheel_type wheel;
     std::size_t segment_bytes;
     std::size_t tile_bytes;
+    // 0, or K to find the K-th prime of [from,to). Without prime delivery
+    // count_method counts up to a bound near it and threads sieve the rest.
     std::uint64_t nth_index;
     int collect_primes;
     int use_meissel;
@@ -76,6 +98,15 @@ typedef struct calcprime_range_options {
     calcprime_progress_callback progress_callback;
     void*progress_user_data;
     calcprime_cancel_token*cancel_token;
+    calcprime_sieve_layout layout;
+    // Sieving-prime cache file; NULL falls back to CALCPRIME_PRIME_CACHE and
+    // an empty string disables the cache.
+    const char*prime_cache_path;
+    // Tiny windows at extreme heights: sieve with small primes only and
+    // confirm candidates with Miller-Rabin (AUTO decides by a cost model).
+    calcprime_hybrid_mode hybrid;
+    // use_meissel!=0 forces CALCPRIME_COUNT_ANALYTIC.
+    calcprime_count_method count_method;
 } calcprime_range_options;
 
 typedef struct calcprime_range_stats {
@@ -92,9 +123,12 @@ typedef struct calcprime_range_stats {
     std::uint64_t prime_count;
     std::uint64_t nth_index;
     int nth_found;
+    // 1 when the count, or the count below the nth prime, was analytic.
     int use_meissel;
     int completed;
     int cancelled;
+    // Sieving-prime bound of the hybrid strategy, 0 for the full sieve.
+    std::uint64_t hybrid_bound;
 } calcprime_range_stats;
 
 struct calcprime_range_run_result;
@@ -106,6 +140,19 @@ CALCPRIME_API std::uint64_t calcprime_meissel_count(std::uint64_t from,std::uint
 
 CALCPRIME_API int calcprime_miller_rabin_is_prime(std::uint64_t n);
 
+// out[i]=1 when values[i] is prime, else 0; threads=0 uses every core.
+// Returns 0 on success, -1 on invalid arguments or allocation failure.
+CALCPRIME_API int calcprime_is_prime_batch(const std::uint64_t*values,std::size_t count,std::uint8_t*out,unsigned threads);
+
+// Single queries on the calling thread. Return 0 and store the prime, or -1
+// when there is none: above 18446744073709551557 or at or below 2.
+CALCPRIME_API int calcprime_next_prime(std::uint64_t n,std::uint64_t*out_prime);
+CALCPRIME_API int calcprime_prev_prime(std::uint64_t n,std::uint64_t*out_prime);
+
+// Up to k primes below n followed by up to k primes from n upwards, in
+// ascending order; out needs room for 2*k values.
+CALCPRIME_API int calcprime_primes_around(std::uint64_t n,std::size_t k,std::uint64_t*out,std::size_t*out_count);
+
 CALCPRIME_API int calcprime_simple_sieve(std::uint64_t limit,std::uint32_t**out_primes,std::size_t*out_count);
 
 CALCPRIME_API void calcprime_release_u32_buffer(std::uint32_t*buffer);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "base_sieve.h"
+#include "segmenter.h"
+
+#include <cstdint>
+
+namespace calcprime {
+
+// pi(x) by the combinatorial method of Deleglise and Rivat in about
+// x^(2/3)/log^2 x time: pi(x)=phi(x,a)+a-1-P2(x,a) with a=pi(y) and
+// y=alpha*x^(1/3). phi(x,a) splits into ordinary leaves, summed
+// recursively, and special leaves. Those whose value lies below y are read
+// from a pi table (trivial and easy leaves); the hard ones are counted on a
+// segmented sieve of [1,x/y] with per-block counters, in chunks whose
+// partial counts are merged in order, so threads need no shared sieve
+// state. primes must reach isqrt(x).
+std::uint64_t deleglise_rivat_pi(std::uint64_t x,const BasePrimes&primes,unsigned threads=0);
+
+// Primes in [from,to) as pi(to-1)-pi(from-1); primes must reach isqrt(to-1).
+std::uint64_t deleglise_rivat_count(std::uint64_t from,std::uint64_t to,const BasePrimes&primes,unsigned threads=0);
+
+// How a count is carried out: the segmented sieve or two evaluations of
+// deleglise_rivat_pi.
+enum class CountMethod {
+    Auto,
+    Sieve,
+    Analytic,
+};
+
+// Sieve or Analytic for counting [from,to) with segments of config. Auto
+// weighs marking the range (a fixed cost per number plus one bucket hit
+// per crossing of a large prime) against pi(to-1) and pi(from-1). Both
+// plans load the sieving primes up to sqrt(to), so those are left out.
+CountMethod choose_count_method(CountMethod mode,std::uint64_t from,std::uint64_t to,const SegmentConfig&config);
+
+const char*count_method_name(CountMethod method);
+
+}
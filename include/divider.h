@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+namespace calcprime {
+
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 u128;
+#endif
+
+inline std::uint64_t mul_high_u64(std::uint64_t a,std::uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    return static_cast<std::uint64_t>((static_cast<u128>(a)*b)>>64);
+#elif defined(_MSC_VER)
+    return __umulh(a,b);
+#else
+    std::uint64_t a_lo=a&0xFFFFFFFFULL;
+    std::uint64_t a_hi=a>>32;
+    std::uint64_t b_lo=b&0xFFFFFFFFULL;
+    std::uint64_t b_hi=b>>32;
+    std::uint64_t lo_lo=a_lo*b_lo;
+    std::uint64_t hi_lo=a_hi*b_lo;
+    std::uint64_t lo_hi=a_lo*b_hi;
+    std::uint64_t cross=(lo_lo>>32)+(hi_lo&0xFFFFFFFFULL)+lo_hi;
+    return a_hi*b_hi+(hi_lo>>32)+(cross>>32);
+#endif
+}
+
+// Unsigned 64-bit division by a divisor fixed at run time, done as a
+// multiply-high and two shifts (Granlund-Montgomery round-up method, as in
+// libdivide's branch-free u64 path). Exact for every 64-bit numerator.
+struct FastDivider {
+    std::uint64_t divisor=1;
+    std::uint64_t magic=1;
+    std::uint8_t shift1=0;
+    std::uint8_t shift2=0;
+
+    FastDivider()=default;
+
+    explicit FastDivider(std::uint64_t d) : divisor(d) {
+        // l=ceil(log2 d), magic=floor(2^64*(2^l-d)/d)+1.
+        unsigned l=0;
+        while(l<64&&(1ULL<<l)<d) {
+            ++l;
+        }
+#if defined(__SIZEOF_INT128__)
+        u128 numerator=((static_cast<u128>(1)<<l)-d)<<64;
+        magic=static_cast<std::uint64_t>(numerator/d)+1;
+#elif defined(_MSC_VER)
+        std::uint64_t high=l==64?0-d:(1ULL<<l)-d;
+        std::uint64_t remainder=0;
+        magic=_udiv128(high,0,d,&remainder)+1;
+#else
+#error "FastDivider needs 128-bit arithmetic"
+#endif
+        shift1=static_cast<std::uint8_t>(l<1?l:1);
+        shift2=static_cast<std::uint8_t>(l<1?0:l-1);
+    }
+
+    std::uint64_t divide(std::uint64_t n) const {
+        std::uint64_t t=mul_high_u64(magic,n);
+        return (t+((n-t)>>shift1))>>shift2;
+    }
+
+    std::uint64_t remainder(std::uint64_t n) const {
+        return n-divide(n)*divisor;
+    }
+};
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace calcprime {
+
+enum class KernelIsa {
+    Scalar,
+    Avx2,
+    Avx512,
+};
+
+// Small-prime pattern streams are ORed four at a time, and every stream
+// carries kSmallStreamPad words past its period so a full-width read from
+// any cursor below the period stays in bounds.
+inline constexpr std::size_t kSmallStreamGroup=4;
+inline constexpr std::size_t kSmallStreamPad=7;
+
+struct KernelTable {
+    KernelIsa isa;
+    // Number of clear bits among the first bit_count bits.
+    std::uint64_t (*count_zero_bits)(const std::uint64_t*bits,std::size_t bit_count);
+    // dst[i]=(src[i]>>shift)|(src[i+1]<<(64-shift)) for 0<shift<64.
+    void (*shift_copy)(std::uint64_t*dst,const std::uint64_t*src,std::size_t word_count,unsigned shift);
+    // ORs kSmallStreamGroup pattern streams into words, advancing cursors.
+    void (*or_small_streams)(std::uint64_t*words,std::size_t word_count,const std::uint64_t*const*streams,const std::uint32_t*periods,std::uint32_t*cursors);
+    // Write low+2*i for every clear bit i<bit_count; return the count. The
+    // extraction kernels never write past the last prime, so out can be
+    // sized exactly from count_zero_bits.
+    std::size_t (*extract_odd_bits)(const std::uint64_t*bits,std::size_t bit_count,std::uint64_t low,std::uint64_t*out);
+    // Write low+30*k+residue for every clear bit of the mod-30 bytes; return the count.
+    std::size_t (*extract_wheel30_bytes)(const std::uint8_t*bytes,std::size_t byte_count,std::uint64_t low,std::uint64_t*out);
+    // For each prime p, the first multiple p*m>=start with m>=p and m coprime
+    // to 30: distances[i]=p*m-start and wheel_indices[i]=m's wheel-30 index.
+    // The vector kernels estimate start/p in double precision and need
+    // start/p<2^50; scalar_kernels() has no such limit.
+    void (*first_wheel30_hits)(const std::uint32_t*primes,std::size_t count,std::uint64_t start,std::uint64_t*distances,std::uint32_t*wheel_indices);
+    // One Miller-Rabin round per odd modulus n[i]>2 in Montgomery form
+    // (R=2^64): one[i]=R mod n[i] and bases[i]=a*R mod n[i] for base a, or
+    // bases==nullptr for base 2. pass[i]=1 for a strong probable prime.
+    void (*strong_probable_primes)(const std::uint64_t*n,const std::uint64_t*one,const std::uint64_t*bases,std::size_t count,std::uint8_t*pass);
+};
+
+// Quotients start/p below this bound are safe for the vector first_wheel30_hits.
+inline constexpr std::uint64_t kFirstHitQuotientLimit=1ULL<<50;
+
+// Picked once on first use from cpuid, capped by CALCPRIME_ISA
+// (scalar|avx2|avx512) when that environment variable is set.
+const KernelTable&active_kernels();
+const char*kernel_isa_name(KernelIsa isa);
+
+const KernelTable&scalar_kernels();
+const KernelTable*avx2_kernels();
+const KernelTable*avx512_kernels();
+
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "base_sieve.h"
 #include "bucket.h"
+#include "divider.h"
 #include "segmenter.h"
 #include "wheel.h"
 
@@ -10,10 +12,21 @@
 
 namespace calcprime {
 
-struct LargePrimeState {
-    std::uint32_t prime;
+struct MediumPrimeState {
     std::uint64_t next_value;
-    std::uint64_t stride;
+    std::uint32_t wheel_index;
+};
+
+struct PackedPrimeState {
+    std::uint64_t byte;
+    std::uint32_t wheel_index;
+};
+
+// Position of a tile-tier prime as a unit index from the segment origin
+// (bits of the odd-only bitset, bytes of the packed layout).
+struct TilePrimeState {
+    std::uint64_t next_unit;
+    std::uint32_t wheel_index;
 };
 
 struct TileView {
@@ -24,20 +37,52 @@ struct TileView {
     std::size_t word_count;
 };
 
+// Optional output of sieve_segment: every tile is counted right after its
+// last marking pass, while it is still in L1. tile_counts, when set, gets
+// one entry per tile in segment order.
+struct SegmentCounts {
+    std::uint64_t total=0;
+    std::vector<std::uint32_t>*tile_counts=nullptr;
+};
+
+// How a range is sieved. Hybrid sieves only with primes up to a modest
+// bound and confirms the surviving candidates with Miller-Rabin.
+enum class HybridMode {
+    Auto,
+    Off,
+    On,
+};
+
+// Sieving-prime bound for the hybrid strategy on [range_begin,range_end),
+// or 0 for the full sieve. Auto compares the cost of reading every prime
+// up to the square root (and generating them unless cached_primes) with
+// the cost of testing the candidates left after the small and medium tiers.
+std::uint64_t hybrid_sieve_bound(HybridMode mode,const SegmentConfig&config,std::uint64_t range_begin,std::uint64_t range_end,bool cached_primes);
+
+// When the sieving primes stop below the square root of the range end,
+// every number the marker leaves clear is confirmed with Miller-Rabin.
 class PrimeMarker {
 public:
-    PrimeMarker(const Wheel&wheel,SegmentConfig config,std::uint64_t range_begin,std::uint64_t range_end,const std::vector<std::uint32_t>&primes,std::uint32_t small_prime_limit=29);
+    PrimeMarker(const Wheel&wheel,SegmentConfig config,std::uint64_t range_begin,std::uint64_t range_end,const BasePrimes&primes,std::uint32_t small_prime_limit=97,unsigned threads=1);
 
     struct ThreadState {
         BucketRing bucket;
-        std::vector<std::uint64_t>small_positions;
-        std::vector<LargePrimeState>large_states;
-        std::vector<std::uint64_t>medium_positions;
+        BucketRing tile_bucket;
+        std::vector<MediumPrimeState>medium_positions;
+        std::vector<PackedPrimeState>packed_positions;
+        std::vector<TilePrimeState>tile_positions;
+        std::size_t next_large=0;
     };
 
-    ThreadState make_thread_state(std::size_t thread_index,std::size_t thread_count) const;
+    ThreadState make_thread_state(std::uint64_t first_segment) const;
+
+    void sieve_segment(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset,SegmentCounts*counts=nullptr) const;
 
-    void sieve_segment(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset) const;
+    std::size_t segment_bits(std::uint64_t segment_low,std::uint64_t segment_high) const;
+    void collect_primes(const std::vector<std::uint64_t>&bitset,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&primes) const;
+    // Writes the segment's primes to out, which must hold the segment count
+    // (SegmentCounts::total); returns the number written.
+    std::size_t extract_primes(const std::vector<std::uint64_t>&bitset,std::uint64_t segment_low,std::uint64_t segment_high,std::uint64_t*out) const;
 
     const SegmentConfig&config() const { return config_;}
 
@@ -46,17 +91,47 @@ private:
     SegmentConfig config_;
     std::uint64_t range_begin_;
     std::uint64_t range_end_;
-    std::vector<std::uint32_t>small_primes_;
-    std::vector<std::uint64_t>small_initial_;
+    std::uint64_t segment_origin_;
     std::vector<const SmallPrimePattern*>small_prime_patterns_;
     std::vector<std::uint32_t>medium_primes_;
-    std::vector<std::uint64_t>medium_initial_;
-    std::vector<LargePrimeState>large_primes_template_;
+    std::vector<std::uint32_t>tile_primes_;
+    std::vector<std::uint32_t>large_primes_;
+    // Primes of at least half the range length cross it at most once. Their
+    // hits skip the buckets: bit positions within the segment (byte*8+bit in
+    // the packed layout), grouped by segment, sparse_offsets_ indexing them.
+    std::vector<std::size_t>sparse_offsets_;
+    std::vector<std::uint32_t>sparse_hits_;
+    // Reciprocals of the small, medium and tile primes and of the segment
+    // and tile sizes, so repositioning and bucket filing never divide.
+    std::vector<FastDivider>small_dividers_;
+    std::vector<FastDivider>medium_dividers_;
+    std::vector<FastDivider>tile_dividers_;
+    FastDivider segment_divider_;
+    FastDivider tile_divider_;
+    std::uint64_t segment_units_;
+    std::uint64_t tile_units_;
+    std::size_t tiles_per_segment_;
+    std::uint64_t segment_count_;
+    std::size_t bucket_distance_;
+    const PackedPresieve*packed_presieve_;
+    bool confirm_candidates_=false;
 
-    static std::uint64_t first_hit(std::uint32_t prime,std::uint64_t start);
-    void apply_small_primes(ThreadState&state,const TileView&tile) const;
+    void filter_large_primes(const BasePrimes&primes,std::size_t first,unsigned threads);
+    MediumPrimeState medium_position(const FastDivider&prime,std::uint64_t start) const;
+    bool packed() const { return config_.layout==SieveLayout::Mod30Bytes;}
+    PackedPrimeState packed_position(const FastDivider&prime,std::uint64_t start) const;
+    void apply_small_primes(const TileView&tile) const;
     void apply_medium_primes(ThreadState&state,const TileView&tile,std::size_t segment_index) const;
+    TilePrimeState tile_position(const FastDivider&prime,std::uint64_t start) const;
+    void fill_tile_buckets(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::size_t limit) const;
+    void apply_tile_primes(ThreadState&state,std::uint64_t segment_id,std::size_t tile,std::size_t limit,std::uint64_t*bits) const;
+    void apply_sparse_hits(std::uint64_t segment_id,std::uint64_t*bits) const;
     void apply_large_primes(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset) const;
+    void advance_bucket(ThreadState&state,std::uint64_t segment_id,std::size_t limit,std::uint64_t*bits) const;
+    void confirm_odd_bits(std::uint64_t*words,std::size_t bit_count,std::uint64_t low) const;
+    void confirm_wheel30_bytes(std::uint8_t*bytes,std::size_t byte_count,std::uint64_t low) const;
+    void apply_packed_primes(ThreadState&state,std::uint64_t tile_byte,std::size_t tile_bytes,std::uint8_t*bytes) const;
+    void sieve_packed_segment(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset,SegmentCounts*counts) const;
 };
 
 }
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "deleglise_rivat.h"
+#include "marker.h"
+#include "prime_cache.h"
+#include "segmenter.h"
+#include "wheel.h"
+
+#include <cstdint>
+#include <string>
+
+namespace calcprime {
+
+struct NthPrime {
+    // 0 when the range holds fewer than k primes.
+    std::uint64_t prime=0;
+    // The primes of [from,counted_to) were counted by count_method rather
+    // than sieved window by window; counted_to==from when none were.
+    std::uint64_t counted_to=0;
+    CountMethod count_method=CountMethod::Sieve;
+    // Sieving-prime bound of the hybrid strategy, 0 for the full sieve.
+    std::uint64_t hybrid_bound=0;
+    PrimeCacheOutcome cache_outcome=PrimeCacheOutcome::Disabled;
+};
+
+// The k-th prime (k>=1) of [from,to) on all threads. The inverse of
+// Riemann's R places it; the primes below a lower bound a few square roots
+// short of that are counted by choose_count_method(mode,...), and the rest
+// is sieved in windows with one count per segment, scanned in order to find
+// the segment that holds the prime, which is then sieved again and listed.
+// Sieving primes come from the cache at cache_path, or are generated when
+// it is empty, up to the square root of the furthest point reached; when
+// nothing is counted, hybrid_sieve_bound(hybrid,...) may cut them short.
+NthPrime find_nth_prime(std::uint64_t from,std::uint64_t to,std::uint64_t k,const Wheel&wheel,const SegmentConfig&config,CountMethod mode,HybridMode hybrid,const std::string&cache_path,unsigned threads=0);
+
+}
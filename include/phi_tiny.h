@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+namespace calcprime {
+
+// phi(x,a), the count of 1<=n<=x free of the first a primes, is periodic
+// in x with period the product of those primes; up to this a the periods
+// are tabulated and phi costs one division.
+constexpr unsigned kPhiTinyMaxA=6;
+
+std::uint64_t phi_tiny(std::uint64_t x,unsigned a);
+
+}
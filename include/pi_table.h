@@ -0,0 +1,45 @@
+#pragma once
+
+#include "base_sieve.h"
+
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+namespace calcprime {
+
+// pi(n) in constant time for every n up to a limit: one bit per odd number
+// and, for every 128 numbers, the count of odd primes below them. Counts
+// are 32-bit, so limits stay below 10^11.
+class PiTable {
+public:
+    PiTable()=default;
+    // primes must reach limit.
+    PiTable(const BasePrimes&primes,std::uint64_t limit);
+
+    // The same table from the segmented sieve, for limits where listing the
+    // primes first would cost more than the table: threads sieve contiguous
+    // blocks and write their words directly.
+    static PiTable sieve(std::uint64_t limit,unsigned threads=1);
+
+    std::uint64_t limit() const { return limit_;}
+
+    // n<=limit().
+    std::uint64_t operator[](std::uint64_t n) const {
+        std::uint64_t word=n>>7;
+        // The odd numbers 128*word+1 ... n, one bit each.
+        unsigned odd_count=static_cast<unsigned>(((n&127)+1)>>1);
+        std::uint64_t mask=odd_count?~0ULL>>(64-odd_count):0;
+        std::uint64_t pi=counts_[word]+static_cast<std::uint64_t>(std::popcount(bits_[word]&mask));
+        return n>=2?pi+1:0;
+    }
+
+private:
+    void fill_counts();
+
+    std::uint64_t limit_=0;
+    std::vector<std::uint64_t>bits_;
+    std::vector<std::uint32_t>counts_;
+};
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "base_sieve.h"
+
+#include <cstdint>
+#include <string>
+
+namespace calcprime {
+
+enum class PrimeCacheOutcome {
+    Disabled,
+    Mapped,
+    Written,
+    WriteFailed,
+};
+
+// Sieving primes shared across runs through a file of byte half-gaps with a
+// header and checksum. A file that covers limit is mapped read-only, so
+// concurrent processes share one copy in the page cache. A missing, damaged
+// or too small file is regenerated and replaced atomically: the new table is
+// written under a temporary name and renamed over the old one. Cache I/O
+// errors never fail the caller; the primes are then generated in memory.
+BasePrimes load_base_primes(const std::string&path,std::uint64_t limit,unsigned threads=1,
+                            PrimeCacheOutcome*outcome=nullptr);
+
+// load_base_primes when path is non-empty, generate_base_primes otherwise.
+BasePrimes sieving_primes(const std::string&cache_path,std::uint64_t limit,unsigned threads=1,
+                          PrimeCacheOutcome*outcome=nullptr);
+
+// The CALCPRIME_PRIME_CACHE environment variable, or an empty string.
+std::string prime_cache_path_from_env();
+
+const char*prime_cache_outcome_name(PrimeCacheOutcome outcome);
+
+}
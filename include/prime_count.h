@@ -9,4 +9,10 @@ std::uint64_t meissel_count(std::uint64_t from,std::uint64_t to,const std::vecto
 
 bool miller_rabin_is_prime(std::uint64_t n);
 
+// out[i]=1 when values[i] is prime, else 0. Blocks of values are shared out
+// to threads (0 picks the machine's thread count); each block is trial
+// divided and its survivors run Miller-Rabin rounds through the active
+// vector kernels, several moduli per instruction.
+void is_prime_batch(const std::uint64_t*values,std::size_t count,std::uint8_t*out,unsigned threads=0);
+
 }
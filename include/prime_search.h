@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace calcprime {
+
+// Primes near a single n, found by sieving small windows on the calling
+// thread. Windows start a few expected gaps (ln n) wide and double until
+// they reach a prime; survivors of the small-prime sieve are confirmed with
+// Miller-Rabin once the window lies beyond what those primes decide alone.
+
+// Smallest prime above n, or 0 when none is below 2^64.
+std::uint64_t next_prime(std::uint64_t n);
+
+// Largest prime below n, or 0 when n<=2.
+std::uint64_t prev_prime(std::uint64_t n);
+
+// Up to k primes below n followed by up to k primes from n upwards, in
+// ascending order; fewer near 2 and 2^64.
+std::vector<std::uint64_t>primes_around(std::uint64_t n,std::size_t k);
+
+}
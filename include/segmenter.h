@@ -5,6 +5,7 @@
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
 namespace calcprime {
 
@@ -13,6 +14,18 @@ struct SieveRange {
     std::uint64_t end;
 };
 
+enum class SieveLayout {
+    OddBits,
+    Mod30Bytes,
+};
+
+// Dynamic hands out segments in order to whichever thread asks next;
+// Contiguous gives each thread one block of consecutive segments.
+enum class SegmentSchedule {
+    Dynamic,
+    Contiguous,
+};
+
 struct SegmentConfig {
     std::size_t segment_bytes;
     std::size_t tile_bytes;
@@ -20,21 +33,30 @@ struct SegmentConfig {
     std::size_t tile_bits;
     std::uint64_t segment_span;
     std::uint64_t tile_span;
+    SieveLayout layout;
 };
 
-SegmentConfig choose_segment_config(const CpuInfo&info,unsigned threads,std::size_t requested_segment_bytes,std::size_t requested_tile_bytes,std::uint64_t range_length);
+SegmentConfig choose_segment_config(const CpuInfo&info,unsigned threads,std::size_t requested_segment_bytes,std::size_t requested_tile_bytes,std::uint64_t range_length,SieveLayout layout=SieveLayout::OddBits);
+
+std::uint64_t segment_origin(std::uint64_t range_begin,const SegmentConfig&config);
 
 class SegmentWorkQueue {
 public:
-    SegmentWorkQueue(SieveRange range,const SegmentConfig&config);
+    SegmentWorkQueue(SieveRange range,const SegmentConfig&config,SegmentSchedule schedule=SegmentSchedule::Dynamic,std::size_t thread_count=1);
 
-    bool next(std::uint64_t&segment_id,std::uint64_t&segment_low,std::uint64_t&segment_high);
+    bool next(std::size_t thread_index,std::uint64_t&segment_id,std::uint64_t&segment_low,std::uint64_t&segment_high);
+    std::uint64_t first_segment(std::size_t thread_index) const;
+    std::size_t segment_count() const;
+    SegmentSchedule schedule() const { return schedule_;}
 
 private:
     SieveRange range_;
     SegmentConfig config_;
+    SegmentSchedule schedule_;
     std::atomic<std::uint64_t>next_segment_;
     std::uint64_t length_;
+    std::vector<std::uint64_t>block_begin_;
+    std::vector<std::uint64_t>block_next_;
 };
 
 }
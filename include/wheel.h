@@ -19,7 +19,12 @@ struct SmallPrimePattern {
     std::uint32_t word_stride;
     std::vector<std::uint64_t>masks;
     std::vector<std::uint32_t>next_phase;
-    std::array<std::uint8_t,64>start_phase;
+    // masks in word order: stream[j] covers a word whose first value is
+    // congruent to 128*j, extended by kSmallStreamPad words so a vector read
+    // starting below prime stays in bounds. stream_index maps the first
+    // value's residue to j.
+    std::vector<std::uint64_t>stream;
+    std::vector<std::uint8_t>stream_index;
 };
 
 struct Wheel {
@@ -29,10 +34,47 @@ struct Wheel {
     std::vector<std::uint16_t>residues;
     std::vector<std::uint16_t>steps;
     std::vector<SmallPrimePattern>small_patterns;
+    std::uint32_t small_prime_limit;
+    std::vector<std::uint32_t>presieve_primes;
+    std::uint32_t presieve_period;
+    std::vector<std::uint64_t>presieve_pattern;
 
-    void apply_presieve(std::uint64_t start_value,std::size_t bit_count,std::uint64_t*bits) const;
+    void fill_presieve(std::uint64_t start_value,std::size_t bit_count,std::uint64_t*bits) const;
 };
 
 const Wheel&get_wheel(WheelType type);
 
+// Mod-30 byte layout: bit b of byte k stands for the value
+// 30*k+kWheel30Residues[b]; multiples of 2, 3 and 5 have no bit at all.
+inline constexpr std::array<std::uint8_t,8>kWheel30Residues{1,7,11,13,17,19,23,29};
+inline constexpr std::array<std::uint8_t,8>kWheel30Gaps{6,4,2,4,2,4,6,2};
+inline constexpr std::array<std::uint8_t,30>kWheel30BitIndex{
+    0xFF,0,0xFF,0xFF,0xFF,0xFF,0xFF,1,0xFF,0xFF,
+    0xFF,2,0xFF,3,0xFF,0xFF,0xFF,4,0xFF,5,
+    0xFF,0xFF,0xFF,6,0xFF,0xFF,0xFF,0xFF,0xFF,7};
+// kWheel30Advance[r]: for a multiplier m with m%30==r, the distance to the
+// nearest multiplier coprime to 30 at or above m (low byte) and that
+// multiplier's bit index (second byte).
+inline constexpr std::array<std::uint64_t,30>kWheel30Advance=[] {
+    std::array<std::uint64_t,30>table{};
+    for(std::uint32_t r=0;r<30;++r) {
+        std::uint32_t delta=0;
+        while(kWheel30BitIndex[(r+delta)%30]==0xFF) {
+            ++delta;
+        }
+        table[r]=delta|(static_cast<std::uint64_t>(kWheel30BitIndex[(r+delta)%30])<<8);
+    }
+    return table;
+}();
+
+struct PackedPresieve {
+    std::vector<std::uint32_t>primes;
+    std::uint32_t period;
+    std::vector<std::uint8_t>pattern;
+
+    void fill(std::uint64_t start_byte,std::size_t byte_count,std::uint8_t*bytes) const;
+};
+
+const PackedPresieve&get_packed_presieve();
+
 }
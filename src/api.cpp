@@ -2,9 +2,13 @@
 
 #include "base_sieve.h"
 #include "cpu_info.h"
+#include "deleglise_rivat.h"
 #include "marker.h"
+#include "nth_prime.h"
 #include "popcnt.h"
+#include "prime_cache.h"
 #include "prime_count.h"
+#include "prime_search.h"
 #include "segmenter.h"
 #include "wheel.h"
 #include "writer.h"
@@ -56,6 +60,79 @@ calcprime::WheelType to_cpp_wheel(calcprime_wheel_type type) {
     return calcprime::WheelType::Mod30;
 }
 
+bool is_valid_layout(calcprime_sieve_layout layout) {
+    switch(layout) {
+    case CALCPRIME_LAYOUT_ODD_BITS:
+    case CALCPRIME_LAYOUT_MOD30_BYTES:
+        return true;
+    }
+    return false;
+}
+
+bool is_valid_hybrid_mode(calcprime_hybrid_mode mode) {
+    switch(mode) {
+    case CALCPRIME_HYBRID_AUTO:
+    case CALCPRIME_HYBRID_OFF:
+    case CALCPRIME_HYBRID_ON:
+        return true;
+    }
+    return false;
+}
+
+calcprime::HybridMode to_cpp_hybrid_mode(calcprime_hybrid_mode mode) {
+    switch(mode) {
+    case CALCPRIME_HYBRID_AUTO:
+        return calcprime::HybridMode::Auto;
+    case CALCPRIME_HYBRID_OFF:
+        return calcprime::HybridMode::Off;
+    case CALCPRIME_HYBRID_ON:
+        return calcprime::HybridMode::On;
+    }
+    return calcprime::HybridMode::Auto;
+}
+
+bool is_valid_count_method(calcprime_count_method method) {
+    switch(method) {
+    case CALCPRIME_COUNT_AUTO:
+    case CALCPRIME_COUNT_SIEVE:
+    case CALCPRIME_COUNT_ANALYTIC:
+        return true;
+    }
+    return false;
+}
+
+calcprime::CountMethod to_cpp_count_method(calcprime_count_method method) {
+    switch(method) {
+    case CALCPRIME_COUNT_AUTO:
+        return calcprime::CountMethod::Auto;
+    case CALCPRIME_COUNT_SIEVE:
+        return calcprime::CountMethod::Sieve;
+    case CALCPRIME_COUNT_ANALYTIC:
+        return calcprime::CountMethod::Analytic;
+    }
+    return calcprime::CountMethod::Auto;
+}
+
+calcprime::SieveLayout to_cpp_layout(calcprime_sieve_layout layout) {
+    switch(layout) {
+    case CALCPRIME_LAYOUT_ODD_BITS:
+        return calcprime::SieveLayout::OddBits;
+    case CALCPRIME_LAYOUT_MOD30_BYTES:
+        return calcprime::SieveLayout::Mod30Bytes;
+    }
+    return calcprime::SieveLayout::OddBits;
+}
+
+calcprime_sieve_layout to_c_layout(calcprime::SieveLayout layout) {
+    switch(layout) {
+    case calcprime::SieveLayout::OddBits:
+        return CALCPRIME_LAYOUT_ODD_BITS;
+    case calcprime::SieveLayout::Mod30Bytes:
+        return CALCPRIME_LAYOUT_MOD30_BYTES;
+    }
+    return CALCPRIME_LAYOUT_ODD_BITS;
+}
+
 calcprime::PrimeOutputFormat to_cpp_output(calcprime_output_format format) {
     switch(format) {
     case CALCPRIME_OUTPUT_TEXT:
@@ -100,6 +177,7 @@ calcprime_segment_config to_c_segment_config(const calcprime::SegmentConfig&conf
     out.tile_bits=config.tile_bits;
     out.segment_span=config.segment_span;
     out.tile_span=config.tile_span;
+    out.layout=to_c_layout(config.layout);
     return out;
 }
 
@@ -125,14 +203,17 @@ struct RangeOptions {
     std::uint64_t to=0;
     unsigned threads=0;
     calcprime::WheelType wheel=calcprime::WheelType::Mod30;
+    calcprime::SieveLayout layout=calcprime::SieveLayout::OddBits;
+    calcprime::HybridMode hybrid=calcprime::HybridMode::Auto;
     std::size_t segment_bytes=0;
     std::size_t tile_bytes=0;
     std::uint64_t nth_index=0;
     bool collect_primes=false;
-    bool use_meissel=false;
+    calcprime::CountMethod count_method=calcprime::CountMethod::Auto;
     bool write_to_file=false;
     calcprime::PrimeOutputFormat output_format=calcprime::PrimeOutputFormat::Text;
     std::string output_path;
+    std::string prime_cache_path;
     calcprime_prime_chunk_callback prime_callback=nullptr;
     void*prime_user_data=nullptr;
     calcprime_progress_callback progress_callback=nullptr;
@@ -146,16 +227,20 @@ RangeOptions make_range_options(const calcprime_range_options&opts) {
     result.to=opts.to;
     result.threads=opts.threads;
     result.wheel=to_cpp_wheel(opts.wheel);
+    result.layout=to_cpp_layout(opts.layout);
+    result.hybrid=to_cpp_hybrid_mode(opts.hybrid);
     result.segment_bytes=opts.segment_bytes;
     result.tile_bytes=opts.tile_bytes;
     result.nth_index=opts.nth_index;
     result.collect_primes=opts.collect_primes!=0;
-    result.use_meissel=opts.use_meissel!=0;
+    result.count_method=opts.use_meissel!=0?calcprime::CountMethod::Analytic:to_cpp_count_method(opts.count_method);
     result.write_to_file=opts.write_to_file!=0;
     result.output_format=to_cpp_output(opts.output_format);
     if(opts.output_path) {
         result.output_path=opts.output_path;
     }
+    result.prime_cache_path=opts.prime_cache_path?std::string(opts.prime_cache_path):
+                                                  calcprime::prime_cache_path_from_env();
     result.prime_callback=opts.prime_callback;
     result.prime_user_data=opts.prime_callback_user_data;
     result.progress_callback=opts.progress_callback;
@@ -196,14 +281,65 @@ extern"C" std::uint64_t calcprime_meissel_count(std::uint64_t from,std::uint64_t
         sqrt_limit=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(to)))+
                      1;
     }
-    auto primes=calcprime::simple_sieve(sqrt_limit);
-    return calcprime::meissel_count(from,to,primes,threads);
+    auto primes=calcprime::sieving_primes(calcprime::prime_cache_path_from_env(),sqrt_limit,threads);
+    return calcprime::deleglise_rivat_count(from,to,primes,threads);
 }
 
 extern"C" int calcprime_miller_rabin_is_prime(std::uint64_t n) {
     return calcprime::miller_rabin_is_prime(n) ? 1 : 0;
 }
 
+extern"C" int calcprime_is_prime_batch(const std::uint64_t*values,std::size_t count,std::uint8_t*out,unsigned threads) {
+    if(count>0&&(!values||!out)) {
+        return-1;
+    }
+    try {
+        calcprime::is_prime_batch(values,count,out,threads);
+    } catch(const std::exception&) {
+        return-1;
+    }
+    return 0;
+}
+
+extern"C" int calcprime_next_prime(std::uint64_t n,std::uint64_t*out_prime) {
+    if(!out_prime) {
+        return-1;
+    }
+    std::uint64_t prime=calcprime::next_prime(n);
+    if(prime==0) {
+        return-1;
+    }
+    *out_prime=prime;
+    return 0;
+}
+
+extern"C" int calcprime_prev_prime(std::uint64_t n,std::uint64_t*out_prime) {
+    if(!out_prime) {
+        return-1;
+    }
+    std::uint64_t prime=calcprime::prev_prime(n);
+    if(prime==0) {
+        return-1;
+    }
+    *out_prime=prime;
+    return 0;
+}
+
+extern"C" int calcprime_primes_around(std::uint64_t n,std::size_t k,std::uint64_t*out,std::size_t*out_count) {
+    if(!out_count||(k>0&&!out)) {
+        return-1;
+    }
+    *out_count=0;
+    try {
+        std::vector<std::uint64_t>primes=calcprime::primes_around(n,k);
+        std::copy(primes.begin(),primes.end(),out);
+        *out_count=primes.size();
+    } catch(const std::exception&) {
+        return-1;
+    }
+    return 0;
+}
+
 extern"C" int calcprime_simple_sieve(std::uint64_t limit,std::uint32_t**out_primes,std::size_t*out_count) {
     if(!out_primes||!out_count) {
         return-1;
@@ -282,6 +418,7 @@ extern"C" calcprime_segment_config calcprime_choose_segment_config(const calcpri
     config.tile_bits=cpp_config.tile_bits;
     config.segment_span=cpp_config.segment_span;
     config.tile_span=cpp_config.tile_span;
+    config.layout=to_c_layout(cpp_config.layout);
     return config;
 }
 
@@ -306,6 +443,10 @@ extern"C" int calcprime_range_options_init(calcprime_range_options*options) {
     options->progress_callback=nullptr;
     options->progress_user_data=nullptr;
     options->cancel_token=nullptr;
+    options->layout=CALCPRIME_LAYOUT_ODD_BITS;
+    options->prime_cache_path=nullptr;
+    options->hybrid=CALCPRIME_HYBRID_AUTO;
+    options->count_method=CALCPRIME_COUNT_AUTO;
     return 0;
 }
 
@@ -376,6 +517,22 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
         *out_result=result.release();
         return CALCPRIME_STATUS_INVALID_ARGUMENT;
     }
+    if(!is_valid_layout(options->layout)||
+       (options->layout==CALCPRIME_LAYOUT_MOD30_BYTES&&options->wheel!=CALCPRIME_WHEEL_MOD30)) {
+        result->error_message="invalid sieve layout";
+        *out_result=result.release();
+        return CALCPRIME_STATUS_INVALID_ARGUMENT;
+    }
+    if(!is_valid_hybrid_mode(options->hybrid)) {
+        result->error_message="invalid hybrid mode";
+        *out_result=result.release();
+        return CALCPRIME_STATUS_INVALID_ARGUMENT;
+    }
+    if(!is_valid_count_method(options->count_method)) {
+        result->error_message="invalid count method";
+        *out_result=result.release();
+        return CALCPRIME_STATUS_INVALID_ARGUMENT;
+    }
     if(!is_valid_output_format(options->output_format)) {
         result->error_message="invalid output format";
         *out_result=result.release();
@@ -398,9 +555,10 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
     result->stats.prime_count=0;
     result->stats.nth_index=opts.nth_index;
     result->stats.nth_found=0;
-    result->stats.use_meissel=opts.use_meissel ? 1 : 0;
+    result->stats.use_meissel=0;
     result->stats.completed=0;
     result->stats.cancelled=0;
+    result->stats.hybrid_bound=0;
     result->primes_collected=opts.collect_primes;
     result->prime_chunks.clear();
     result->stored_prime_total=0;
@@ -417,9 +575,9 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
     }
 
     bool need_prime_delivery=opts.collect_primes||opts.write_to_file||(opts.prime_callback!=nullptr);
-    if(opts.use_meissel&&(need_prime_delivery||opts.nth_index!=0)) {
+    if(opts.count_method==calcprime::CountMethod::Analytic&&need_prime_delivery) {
         result->status=CALCPRIME_STATUS_INVALID_ARGUMENT;
-        result->error_message="Meissel counting cannot emit primes";
+        result->error_message="analytic counting cannot emit primes";
         *out_result=result.release();
         return CALCPRIME_STATUS_INVALID_ARGUMENT;
     }
@@ -428,7 +586,9 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
     result->stats.cpu=to_c_cpu_info(cpu_info);
 
     unsigned threads=opts.threads ? opts.threads : calcprime::effective_thread_count(cpu_info);
-    if(opts.nth_index!=0) {
+    // nth_index with primes delivered walks them in order on one thread.
+    bool parallel_nth=opts.nth_index!=0&&!need_prime_delivery;
+    if(opts.nth_index!=0&&!parallel_nth) {
         threads=1;
     }
     if(threads==0) {
@@ -436,17 +596,24 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
     }
     result->stats.threads=threads;
 
+    calcprime::CountMethod count_method=calcprime::CountMethod::Sieve;
+    if(!need_prime_delivery&&opts.nth_index==0) {
+        calcprime::SegmentConfig plan_config=calcprime::choose_segment_config(cpu_info,threads,opts.segment_bytes,opts.tile_bytes,opts.to-opts.from,opts.layout);
+        count_method=calcprime::choose_count_method(opts.count_method,opts.from,opts.to,plan_config);
+    }
+    result->stats.use_meissel=count_method==calcprime::CountMethod::Analytic ? 1 : 0;
+
     auto start_time=std::chrono::steady_clock::now();
 
-    if(opts.use_meissel) {
+    if(count_method==calcprime::CountMethod::Analytic) {
         try {
             std::uint64_t sqrt_limit=0;
             if(opts.to>1) {
                 sqrt_limit=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(opts.to)))+
                              1;
             }
-            auto primes=calcprime::simple_sieve(sqrt_limit);
-            std::uint64_t count=calcprime::meissel_count(opts.from,opts.to,primes,threads);
+            auto primes=calcprime::sieving_primes(opts.prime_cache_path,sqrt_limit,threads);
+            std::uint64_t count=calcprime::deleglise_rivat_count(opts.from,opts.to,primes,threads);
             auto end_time=std::chrono::steady_clock::now();
             auto elapsed=std::chrono::duration_cast<std::chrono::microseconds>(end_time-start_time);
             result->total_count=count;
@@ -501,34 +668,69 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
     calcprime::SieveRange range{odd_begin,odd_end};
     std::uint64_t length=(range.end>range.begin)?(range.end-range.begin):0;
 
-    calcprime::SegmentConfig config=calcprime::choose_segment_config(cpu_info,threads,opts.segment_bytes,opts.tile_bytes,length);
+    calcprime::SegmentConfig config=calcprime::choose_segment_config(cpu_info,threads,opts.segment_bytes,opts.tile_bytes,length,opts.layout);
     result->stats.segment=to_c_segment_config(config);
 
-    std::size_t num_segments=length?static_cast<std::size_t>((length+config.segment_span-1)/config.segment_span):0;
+    if(parallel_nth) {
+        try {
+            calcprime::NthPrime nth=calcprime::find_nth_prime(opts.from,opts.to,opts.nth_index,wheel,config,opts.count_method,opts.hybrid,opts.prime_cache_path,threads);
+            auto end_time=std::chrono::steady_clock::now();
+            auto elapsed=std::chrono::duration_cast<std::chrono::microseconds>(end_time-start_time);
+            result->stats.elapsed_us=static_cast<std::uint64_t>(elapsed.count());
+            result->stats.use_meissel=nth.count_method==calcprime::CountMethod::Analytic ? 1 : 0;
+            result->stats.hybrid_bound=nth.hybrid_bound;
+            if(nth.prime!=0) {
+                // Every prime of [from,nth_value] was accounted for.
+                result->total_count=opts.nth_index;
+                result->stats.prime_count=opts.nth_index;
+                result->nth_found=1;
+                result->stats.nth_found=1;
+                result->nth_value=nth.prime;
+                result->stats.completed=1;
+            } else {
+                result->status=CALCPRIME_STATUS_INTERNAL_ERROR;
+                result->error_message="nth prime not found within range";
+            }
+        } catch(const std::exception&ex) {
+            result->status=CALCPRIME_STATUS_INTERNAL_ERROR;
+            result->error_message=ex.what();
+        } catch(...) {
+            result->status=CALCPRIME_STATUS_INTERNAL_ERROR;
+            result->error_message="unknown error";
+        }
+
+        if(opts.progress_callback&&result->status==CALCPRIME_STATUS_SUCCESS) {
+            try {
+                opts.progress_callback(1.0,opts.progress_user_data);
+            } catch(const std::exception&ex) {
+                result->status=CALCPRIME_STATUS_INTERNAL_ERROR;
+                result->error_message=ex.what();
+            } catch(...) {
+                result->status=CALCPRIME_STATUS_INTERNAL_ERROR;
+                result->error_message="unknown error";
+            }
+        }
+
+        *out_result=result.release();
+        return (*out_result)->status;
+    }
+
+    calcprime::SegmentSchedule schedule=(threads>1&&!need_prime_delivery)?calcprime::SegmentSchedule::Contiguous:
+                                                                            calcprime::SegmentSchedule::Dynamic;
+    calcprime::SegmentWorkQueue queue(range,config,schedule,threads);
+    std::size_t num_segments=queue.segment_count();
     result->stats.segments_total=num_segments;
 
     std::uint64_t sqrt_limit=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(opts.to)))+
                             1;
-    auto base_primes=calcprime::simple_sieve(sqrt_limit);
-
-    std::uint32_t small_limit=29u;
-    switch(wheel_type) {
-    case calcprime::WheelType::Mod30:
-        small_limit=29u;
-        break;
-    case calcprime::WheelType::Mod210:
-        small_limit=47u;
-        break;
-    case calcprime::WheelType::Mod1155:
-        small_limit=47u;
-        break;
-    }
+    std::uint64_t hybrid_bound=calcprime::hybrid_sieve_bound(opts.hybrid,config,range.begin,range.end,!opts.prime_cache_path.empty());
+    result->stats.hybrid_bound=hybrid_bound;
+    calcprime::BasePrimes base_primes=calcprime::sieving_primes(opts.prime_cache_path,hybrid_bound?hybrid_bound:sqrt_limit,threads);
 
     bool need_segment_storage=need_prime_delivery;
     bool need_primes_for_nth=opts.nth_index!=0;
 
-    calcprime::PrimeMarker marker(wheel,config,range.begin,range.end,base_primes,small_limit);
-    calcprime::SegmentWorkQueue queue(range,config);
+    calcprime::PrimeMarker marker(wheel,config,range.begin,range.end,base_primes,wheel.small_prime_limit,threads);
 
     std::vector<SegmentResult>segment_results(num_segments);
     std::mutex segment_ready_mutex;
@@ -605,19 +807,7 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
     if(opts.from<=2&&opts.to>2) {
         prefix_primes.push_back(2);
     }
-    std::vector<std::uint64_t>wheel_primes;
-    switch(wheel_type) {
-    case calcprime::WheelType::Mod30:
-        wheel_primes={3,5};
-        break;
-    case calcprime::WheelType::Mod210:
-        wheel_primes={3,5,7};
-        break;
-    case calcprime::WheelType::Mod1155:
-        wheel_primes={3,5,7,11};
-        break;
-    }
-    for(std::uint64_t p : wheel_primes) {
+    for(std::uint64_t p : wheel.presieve_primes) {
         if(p>=opts.from&&p<opts.to) {
             prefix_primes.push_back(p);
         }
@@ -656,8 +846,9 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
 
     for(unsigned t=0;t<threads;++t) {
         workers.emplace_back([&,t]() {
-            auto state=marker.make_thread_state(t,threads);
+            auto state=marker.make_thread_state(queue.first_segment(t));
             std::vector<std::uint64_t>bitset;
+            calcprime::SegmentCounts counts;
             std::uint64_t cumulative=prefix_total;
             while(!stop.load(std::memory_order_acquire)) {
                 if(opts.cancel_token&&opts.cancel_token->cancelled.load(std::memory_order_acquire)) {
@@ -668,12 +859,11 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
                 std::uint64_t segment_id=0;
                 std::uint64_t seg_low=0;
                 std::uint64_t seg_high=0;
-                if(!queue.next(segment_id,seg_low,seg_high)) {
+                if(!queue.next(t,segment_id,seg_low,seg_high)) {
                     break;
                 }
-                marker.sieve_segment(state,segment_id,seg_low,seg_high,bitset);
-                std::size_t bit_count=static_cast<std::size_t>((seg_high-seg_low)>>1);
-                std::uint64_t local_count=calcprime::count_zero_bits(bitset.data(),bit_count);
+                marker.sieve_segment(state,segment_id,seg_low,seg_high,bitset,&counts);
+                std::uint64_t local_count=counts.total;
                 if(segment_id<segment_results.size()) {
                     segment_results[segment_id].count=local_count;
                 }
@@ -681,19 +871,8 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
                 std::vector<std::uint64_t>primes;
                 bool need_primes=need_segment_storage||(need_primes_for_nth&&threads==1);
                 if(need_primes&&local_count>0) {
-                    primes.reserve(static_cast<std::size_t>(local_count));
-                    std::uint64_t value=seg_low;
-                    std::size_t produced=0;
-                    for(std::size_t word=0;word<bitset.size()&&produced<bit_count;++word) {
-                        std::uint64_t composite=bitset[word];
-                        for(std::size_t bit=0;bit<64&&produced<bit_count;
-                             ++bit,++produced,value+=2) {
-                            if(composite&(1ULL<<bit)) {
-                                continue;
-                            }
-                            primes.push_back(value);
-                        }
-                    }
+                    primes.resize(static_cast<std::size_t>(local_count));
+                    marker.extract_primes(bitset,seg_low,seg_high,primes.data());
                 }
 
                 if(need_primes_for_nth&&threads==1&&!nth_found_flag.load(std::memory_order_acquire)) {
@@ -701,19 +880,8 @@ extern"C" calcprime_status calcprime_run_range(const calcprime_range_options*opt
                     std::uint64_t new_total=base+local_count;
                     if(nth_target>base&&nth_target<=new_total) {
                         if(primes.empty()&&local_count>0) {
-                            primes.reserve(static_cast<std::size_t>(local_count));
-                            std::uint64_t value=seg_low;
-                            std::size_t produced=0;
-                            for(std::size_t word=0;word<bitset.size()&&produced<bit_count;++word) {
-                                std::uint64_t composite=bitset[word];
-                                for(std::size_t bit=0;bit<64&&produced<bit_count;
-                                     ++bit,++produced,value+=2) {
-                                    if(composite&(1ULL<<bit)) {
-                                        continue;
-                                    }
-                                    primes.push_back(value);
-                                }
-                            }
+                            primes.resize(static_cast<std::size_t>(local_count));
+                            marker.extract_primes(bitset,seg_low,seg_high,primes.data());
                         }
                         std::size_t index=static_cast<std::size_t>(nth_target-base-1);
                         if(index<primes.size()) {
@@ -1,36 +1,256 @@
 #include "base_sieve.h"
 
+#include "cpu_info.h"
+#include "marker.h"
+#include "segmenter.h"
+#include "wheel.h"
+
+#include <algorithm>
 #include <cmath>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace calcprime {
+namespace {
+
+// Limits up to here are sieved directly. That covers the seeds of the
+// segmented pass, which stop just above the square root of 2^32.
+constexpr std::uint64_t kDirectSieveLimit=1ULL<<17;
+constexpr std::uint64_t kMaxBaseLimit=0xFFFFFFFFULL;
+
+// Gap buffers of a generated table, one per chunk.
+struct GapBuffer {
+    std::uint32_t first_prime=0;
+    std::vector<std::uint8_t>half_gaps;
+};
+
+void append_prime(GapBuffer&buffer,std::uint32_t&previous,std::uint32_t prime) {
+    if(previous==0) {
+        buffer.first_prime=prime;
+    } else {
+        buffer.half_gaps.push_back(static_cast<std::uint8_t>((prime-previous)/2));
+    }
+    previous=prime;
+}
 
-std::vector<std::uint32_t>simple_sieve(std::uint64_t limit) {
-    if(limit<2) {
-        return {};
+BasePrimes from_buffers(std::uint64_t limit,std::shared_ptr<std::vector<GapBuffer>>buffers) {
+    std::vector<BasePrimes::Chunk>chunks;
+    chunks.reserve(buffers->size());
+    for(const GapBuffer&buffer : *buffers) {
+        BasePrimes::Chunk chunk;
+        chunk.first_prime=buffer.first_prime;
+        chunk.half_gaps=buffer.half_gaps.data();
+        chunk.gap_count=buffer.half_gaps.size();
+        chunks.push_back(chunk);
     }
-    std::uint64_t root=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(limit)));
-    std::uint64_t max=std::max(limit,root+1);
-    std::uint64_t size=(max+1)/2;
-    std::vector<bool>is_composite(size,false);
-    std::uint64_t bound=(static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(max)))+1)/2;
-    for(std::uint64_t i=1;i<=bound;++i) {
+    return BasePrimes(limit,std::move(chunks),std::move(buffers));
+}
+
+BasePrimes direct_sieve(std::uint64_t limit) {
+    auto buffers=std::make_shared<std::vector<GapBuffer>>(1);
+    std::size_t size=static_cast<std::size_t>((limit+1)/2);
+    std::vector<std::uint8_t>is_composite(size,0);
+    for(std::size_t i=1;(2*i+1)*(2*i+1)<=limit;++i) {
         if(!is_composite[i]) {
-            std::uint64_t p=2*i+1;
-            std::uint64_t start=(p*p)/2;
-            for(std::uint64_t j=start;j<size;j+=p) {
-                is_composite[j]=true;
+            std::size_t p=2*i+1;
+            for(std::size_t j=p*p/2;j<size;j+=p) {
+                is_composite[j]=1;
             }
         }
     }
-    std::vector<std::uint32_t>primes;
-    primes.push_back(2);
-    for(std::uint64_t i=1;i<size&&(2*i+1)<=limit;++i) {
+    std::uint32_t previous=0;
+    for(std::size_t i=1;i<size;++i) {
         if(!is_composite[i]) {
-            primes.push_back(static_cast<std::uint32_t>(2*i+1));
+            append_prime((*buffers)[0],previous,static_cast<std::uint32_t>(2*i+1));
+        }
+    }
+    return from_buffers(limit,std::move(buffers));
+}
+
+}
+
+std::uint32_t BasePrimes::Reader::next_chunk() {
+    if(!chunks_||chunk_>=chunks_->size()) {
+        return 0;
+    }
+    const Chunk&chunk=(*chunks_)[chunk_++];
+    pos_=chunk.half_gaps;
+    end_=pos_+chunk.gap_count;
+    value_=chunk.first_prime;
+    return value_;
+}
+
+BasePrimes::BasePrimes(std::uint64_t limit,std::vector<Chunk>chunks,std::shared_ptr<const void>storage)
+    : limit_(limit),storage_(std::move(storage)) {
+    for(Chunk&chunk : chunks) {
+        if(chunk.first_prime==0) {
+            continue;
         }
+        chunk.first_index=size_;
+        size_+=chunk.gap_count+1;
+        chunks_.push_back(chunk);
+    }
+}
+
+BasePrimes::Reader BasePrimes::reader(std::size_t index) const {
+    Reader reader;
+    reader.chunks_=&chunks_;
+    if(index>=size_) {
+        reader.chunk_=chunks_.size();
+        return reader;
+    }
+    auto it=std::upper_bound(chunks_.begin(),chunks_.end(),index,[](std::size_t value,const Chunk&chunk) {
+        return value<chunk.first_index;
+    });
+    std::size_t c=static_cast<std::size_t>(it-chunks_.begin())-1;
+    std::size_t skip=index-chunks_[c].first_index;
+    reader.chunk_=c;
+    if(skip==0) {
+        return reader;
+    }
+    // Stop one gap short, so the next call steps onto the prime at index.
+    const Chunk&chunk=chunks_[c];
+    std::uint32_t value=chunk.first_prime;
+    for(std::size_t k=0;k+1<skip;++k) {
+        value+=2u*chunk.half_gaps[k];
+    }
+    reader.chunk_=c+1;
+    reader.pos_=chunk.half_gaps+(skip-1);
+    reader.end_=chunk.half_gaps+chunk.gap_count;
+    reader.value_=value;
+    return reader;
+}
+
+std::size_t BasePrimes::lower_bound(std::uint64_t value) const {
+    auto it=std::upper_bound(chunks_.begin(),chunks_.end(),value,[](std::uint64_t v,const Chunk&chunk) {
+        return v<chunk.first_prime;
+    });
+    if(it==chunks_.begin()) {
+        return 0;
+    }
+    const Chunk&chunk=*(it-1);
+    std::uint64_t prime=chunk.first_prime;
+    std::size_t index=chunk.first_index;
+    for(std::size_t k=0;prime<value;++k) {
+        if(k==chunk.gap_count) {
+            return index+1;
+        }
+        prime+=2u*chunk.half_gaps[k];
+        ++index;
+    }
+    return index;
+}
+
+std::vector<std::uint32_t>BasePrimes::to_vector() const {
+    std::vector<std::uint32_t>primes;
+    if(limit_<2) {
+        return primes;
+    }
+    primes.reserve(size_+1);
+    primes.push_back(2);
+    Reader it=reader();
+    for(std::size_t i=0;i<size_;++i) {
+        primes.push_back(it.next());
     }
     return primes;
 }
 
+BasePrimes BasePrimes::prefix(std::uint64_t limit) const {
+    if(limit>=limit_) {
+        return*this;
+    }
+    std::vector<Chunk>kept;
+    for(const Chunk&chunk : chunks_) {
+        if(chunk.first_prime>limit) {
+            break;
+        }
+        Chunk cut=chunk;
+        std::uint64_t value=chunk.first_prime;
+        std::size_t count=0;
+        while(count<chunk.gap_count&&value+2u*chunk.half_gaps[count]<=limit) {
+            value+=2u*chunk.half_gaps[count];
+            ++count;
+        }
+        cut.gap_count=count;
+        kept.push_back(cut);
+    }
+    return BasePrimes(limit,std::move(kept),storage_);
+}
+
+BasePrimes generate_base_primes(std::uint64_t limit,unsigned threads) {
+    limit=std::min(limit,kMaxBaseLimit);
+    if(limit<=kDirectSieveLimit) {
+        return direct_sieve(limit);
+    }
+    CpuInfo info=detect_cpu_info();
+    if(threads==0) {
+        threads=effective_thread_count(info);
+    }
+    if(threads==0) {
+        threads=1;
+    }
+
+    const Wheel&wheel=get_wheel(WheelType::Mod30);
+    // The presieved primes never show up in a segment; they open the table.
+    auto buffers=std::make_shared<std::vector<GapBuffer>>(1);
+    std::uint32_t previous=0;
+    for(std::uint32_t p : wheel.presieve_primes) {
+        if(p>2) {
+            append_prime((*buffers)[0],previous,p);
+        }
+    }
+
+    std::uint64_t odd_end=limit+1;
+    if((odd_end&1ULL)==0) {
+        ++odd_end;
+    }
+    SieveRange range{3,odd_end};
+    SegmentConfig config=choose_segment_config(info,threads,0,0,range.end-range.begin,SieveLayout::OddBits);
+    SegmentWorkQueue queue(range,config,SegmentSchedule::Contiguous,threads);
+    BasePrimes seeds=generate_base_primes(static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(range.end)))+1,1);
+    PrimeMarker marker(wheel,config,range.begin,range.end,seeds,wheel.small_prime_limit,threads);
+
+    // One chunk per segment, so no thread waits on another to know where
+    // its gaps start.
+    std::size_t first_segment_chunk=buffers->size();
+    buffers->resize(first_segment_chunk+queue.segment_count());
+    auto work=[&](unsigned t) {
+        auto state=marker.make_thread_state(queue.first_segment(t));
+        std::vector<std::uint64_t>bitset;
+        std::vector<std::uint64_t>primes;
+        SegmentCounts counts;
+        std::uint64_t segment_id=0;
+        std::uint64_t seg_low=0;
+        std::uint64_t seg_high=0;
+        while(queue.next(t,segment_id,seg_low,seg_high)) {
+            marker.sieve_segment(state,segment_id,seg_low,seg_high,bitset,&counts);
+            if(counts.total==0) {
+                continue;
+            }
+            primes.resize(static_cast<std::size_t>(counts.total));
+            marker.extract_primes(bitset,seg_low,seg_high,primes.data());
+            GapBuffer&buffer=(*buffers)[first_segment_chunk+static_cast<std::size_t>(segment_id)];
+            buffer.first_prime=static_cast<std::uint32_t>(primes[0]);
+            buffer.half_gaps.resize(primes.size()-1);
+            for(std::size_t k=1;k<primes.size();++k) {
+                buffer.half_gaps[k-1]=static_cast<std::uint8_t>((primes[k]-primes[k-1])/2);
+            }
+        }
+    };
+    std::vector<std::thread>pool;
+    for(unsigned t=1;t<threads;++t) {
+        pool.emplace_back(work,t);
+    }
+    work(0);
+    for(auto&thread : pool) {
+        thread.join();
+    }
+    return from_buffers(limit,std::move(buffers));
+}
+
+std::vector<std::uint32_t>simple_sieve(std::uint64_t limit,unsigned threads) {
+    return generate_base_primes(limit,threads).to_vector();
+}
+
 }
@@ -1,81 +1,75 @@
 #include "bucket.h"
 
-#include <algorithm>
-#include <iterator>
-
 namespace calcprime {
+namespace {
 
-BucketRing::BucketRing() : base_segment_(0),mask_(0) {}
+constexpr std::size_t kBlocksPerChunk=64;
 
-void BucketRing::reset(std::uint64_t start_segment) {
-    base_segment_=start_segment;
-    mask_=0;
-    buckets_.clear();
 }
 
-void BucketRing::ensure_capacity(std::uint64_t segment) {
-    if(segment<base_segment_) {
-        return;
-    }
-    if(buckets_.empty()) {
-        buckets_.resize(1024);
-        mask_=buckets_.size()-1;
-        return;
+BucketRing::BucketRing() : base_segment_(0),mask_(0),free_(nullptr) {}
+
+void BucketRing::reset(std::uint64_t start_segment,std::size_t max_distance) {
+    for(BucketBlock*head : heads_) {
+        release(head);
     }
-    while((segment-base_segment_)>mask_) {
-        rehash(buckets_.size()*2);
+    // An entry is never pushed more than max_distance segments ahead of the
+    // one being processed, so that many slots plus one never collide.
+    std::size_t size=1;
+    while(size<=max_distance) {
+        size<<=1;
     }
+    heads_.assign(size,nullptr);
+    mask_=size-1;
+    base_segment_=start_segment;
 }
 
-void BucketRing::rehash(std::size_t new_size) {
-    if((new_size&(new_size-1))!=0) {
-
-        std::size_t pow2=1;
-        while(pow2<new_size) {
-            pow2<<=1;
+BucketBlock*BucketRing::allocate() {
+    if(!free_) {
+        std::unique_ptr<BucketBlock[]>chunk(new BucketBlock[kBlocksPerChunk]);
+        for(std::size_t i=0;i<kBlocksPerChunk;++i) {
+            chunk[i].next=free_;
+            free_=&chunk[i];
         }
-        new_size=pow2;
+        chunks_.push_back(std::move(chunk));
     }
-    std::vector<std::vector<BucketEntry>>new_buckets(new_size);
-    std::size_t new_mask=new_size-1;
-    for(auto&bucket : buckets_) {
-        for(auto&entry : bucket) {
-            new_buckets[entry.next_index&new_mask].push_back(entry);
-        }
-    }
-    buckets_=std::move(new_buckets);
-    mask_=new_mask;
+    BucketBlock*block=free_;
+    free_=block->next;
+    block->next=nullptr;
+    block->count=0;
+    return block;
 }
 
 void BucketRing::push(std::uint64_t segment,BucketEntry entry) {
-    ensure_capacity(segment);
-    if(buckets_.empty()) {
-        buckets_.resize(1024);
-        mask_=buckets_.size()-1;
+    BucketBlock*&head=heads_[segment&mask_];
+    if(!head||head->count==BucketBlock::kEntries) {
+        BucketBlock*block=allocate();
+        block->next=head;
+        head=block;
     }
-    buckets_[segment&mask_].push_back(entry);
+    head->entries[head->count++]=entry;
 }
 
-std::vector<BucketEntry>BucketRing::take(std::uint64_t segment) {
-    ensure_capacity(segment);
-    std::vector<BucketEntry>hits;
-    if(buckets_.empty()) {
-        return hits;
-    }
-    auto&bucket=buckets_[segment&mask_];
-    auto first_hit=std::partition(bucket.begin(),bucket.end(),
-        [segment](const BucketEntry&entry) { return entry.next_index!=segment;});
-
-    if(first_hit!=bucket.end()) {
-        hits.reserve(static_cast<std::size_t>(bucket.end()-first_hit));
-        hits.insert(hits.end(),std::make_move_iterator(first_hit),
-                    std::make_move_iterator(bucket.end()));
-        bucket.erase(first_hit,bucket.end());
+BucketBlock*BucketRing::take(std::uint64_t segment) {
+    if(heads_.empty()) {
+        return nullptr;
     }
+    BucketBlock*&head=heads_[segment&mask_];
+    BucketBlock*blocks=head;
+    head=nullptr;
     if(segment>=base_segment_) {
         base_segment_=segment+1;
     }
-    return hits;
+    return blocks;
+}
+
+void BucketRing::release(BucketBlock*blocks) {
+    while(blocks) {
+        BucketBlock*next=blocks->next;
+        blocks->next=free_;
+        free_=blocks;
+        blocks=next;
+    }
 }
 
 }
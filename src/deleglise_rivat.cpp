@@ -0,0 +1,591 @@
+#include "deleglise_rivat.h"
+
+#include "cpu_info.h"
+#include "marker.h"
+#include "phi_tiny.h"
+#include "pi_table.h"
+#include "prime_search.h"
+#include "segmenter.h"
+#include "wheel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace calcprime {
+namespace {
+
+// Below this, x is counted with a plain sieve.
+constexpr std::uint64_t kDirectLimit=1ULL<<24;
+// Cost model of choose_count_method, in nanoseconds on one core: marking
+// one number of a segment, one bucket hit of a large sieving prime, and
+// the factor of x^(2/3)/log^2(x) that deleglise_rivat_pi took from 1e12
+// to 1e16.
+constexpr double kSieveNsPerNumber=0.4;
+constexpr double kSieveNsPerLargeHit=25.0;
+constexpr double kAnalyticNs=900.0;
+// Counter granularity of the hard-leaf sieve, in bits.
+constexpr std::size_t kCounterShift=10;
+constexpr std::size_t kCounterBits=std::size_t{1}<<kCounterShift;
+// m=1 in the factor table: no prime factor, mu=+1.
+constexpr std::int32_t kNoFactor=std::numeric_limits<std::int32_t>::max();
+
+std::uint64_t integer_sqrt(std::uint64_t n) {
+    std::uint64_t root=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(n)));
+    while(root>0&&root>n/root) {
+        --root;
+    }
+    while(root+1<=n/(root+1)) {
+        ++root;
+    }
+    return root;
+}
+
+std::uint64_t integer_cbrt(std::uint64_t n) {
+    std::uint64_t root=static_cast<std::uint64_t>(std::cbrt(static_cast<long double>(n)));
+    auto cube_le=[n](std::uint64_t v) {
+        return v==0||(v<=n/v&&v<=n/v/v);
+    };
+    while(root>0&&!cube_le(root)) {
+        --root;
+    }
+    while(cube_le(root+1)) {
+        ++root;
+    }
+    return root;
+}
+
+double analytic_cost(std::uint64_t x) {
+    if(x<kDirectLimit) {
+        return static_cast<double>(x)*kSieveNsPerNumber;
+    }
+    double log_x=std::log(static_cast<double>(x));
+    return kAnalyticNs*std::pow(static_cast<double>(x),2.0/3.0)/(log_x*log_x);
+}
+
+template<typename F>
+void run_threads(unsigned threads,F&&work) {
+    std::vector<std::thread>pool;
+    for(unsigned t=1;t<threads;++t) {
+        pool.emplace_back(work,t);
+    }
+    work(0u);
+    for(auto&thread : pool) {
+        thread.join();
+    }
+}
+
+// Sums are kept modulo 2^64: every partial term fits, the final pi(x) does,
+// and the signed parts cancel exactly under wrap-around.
+struct Context {
+    std::uint64_t x=0;
+    std::uint64_t y=0;
+    std::uint64_t z=0;
+    unsigned c=0;
+    unsigned threads=1;
+    // 1-based: primes[1]=2, up to the first prime above y.
+    std::vector<std::uint32_t>primes;
+    PiTable pi;
+    // Odd m<=y at m/2: the least prime factor, negated when mu(m)=-1, or 0
+    // when m is not square-free.
+    std::vector<std::int32_t>factors;
+    std::size_t pi_y=0;
+    std::size_t pi_sqrty=0;
+    std::size_t pi_sqrtz=0;
+    std::size_t pi_x13=0;
+    // Last b with hard leaves.
+    std::size_t hard_b=0;
+};
+
+// y=alpha*x^(1/3). A larger alpha moves work from the hard leaves on
+// [1,x/y] to the tables and leaves up to y; log^2(x)/90 was fastest from
+// 10^10 to 10^15.
+double choose_alpha(std::uint64_t x) {
+    double log_x=std::log(static_cast<double>(x));
+    return std::clamp(log_x*log_x/90.0,1.0,60.0);
+}
+
+void build_factor_table(Context&ctx) {
+    std::uint64_t y=ctx.y;
+    ctx.factors.assign(static_cast<std::size_t>(y/2+1),kNoFactor);
+    for(std::size_t b=2;b<=ctx.pi_y;++b) {
+        std::uint64_t p=ctx.primes[b];
+        std::int32_t prime=static_cast<std::int32_t>(p);
+        for(std::uint64_t m=p;m<=y;m+=2*p) {
+            std::int32_t&entry=ctx.factors[static_cast<std::size_t>(m/2)];
+            if(entry==0) {
+                continue;
+            }
+            // Primes come in ascending order, so the first one to reach m
+            // is its least prime factor.
+            std::int32_t lpf=(entry==kNoFactor||entry==-kNoFactor)?prime:std::abs(entry);
+            entry=entry>0?-lpf:lpf;
+        }
+        for(std::uint64_t m=p*p;m<=y;m+=2*p*p) {
+            ctx.factors[static_cast<std::size_t>(m/2)]=0;
+        }
+    }
+}
+
+Context make_context(std::uint64_t x,const BasePrimes&base,unsigned threads) {
+    Context ctx;
+    ctx.x=x;
+    ctx.threads=threads;
+    std::uint64_t sqrtx=integer_sqrt(x);
+    std::uint64_t x13=integer_cbrt(x);
+    std::uint64_t y=static_cast<std::uint64_t>(choose_alpha(x)*static_cast<double>(x13));
+    ctx.y=std::clamp(y,x13,sqrtx);
+    ctx.z=x/ctx.y;
+
+    BasePrimes small=base.prefix(ctx.y);
+    ctx.primes.reserve(small.size()+3);
+    ctx.primes.push_back(0);
+    for(std::uint32_t p : small.to_vector()) {
+        ctx.primes.push_back(p);
+    }
+    // The easy leaves look one prime past y.
+    ctx.primes.push_back(static_cast<std::uint32_t>(next_prime(ctx.y)));
+    ctx.pi=PiTable(small,ctx.y);
+    ctx.pi_y=static_cast<std::size_t>(ctx.pi[ctx.y]);
+    ctx.pi_sqrty=static_cast<std::size_t>(ctx.pi[integer_sqrt(ctx.y)]);
+    ctx.pi_sqrtz=static_cast<std::size_t>(ctx.pi[std::min(integer_sqrt(ctx.z),ctx.y)]);
+    ctx.pi_x13=static_cast<std::size_t>(ctx.pi[x13]);
+    ctx.c=static_cast<unsigned>(std::min<std::size_t>(kPhiTinyMaxA,ctx.pi_y));
+    // Past sqrt(z) or x^(1/3) every leaf value is below y.
+    ctx.hard_b=std::max<std::size_t>(ctx.c,std::min(ctx.pi_x13,ctx.pi_sqrtz));
+    build_factor_table(ctx);
+    return ctx;
+}
+
+// Ordinary leaves mu(n)*phi(x/n,c) of square-free n<=y whose prime factors
+// all exceed p_c, extending n=p_b*... by larger primes depth-first.
+std::uint64_t ordinary_leaves_from(const Context&ctx,std::uint64_t xn,std::uint64_t n,std::size_t b,bool mu_negative) {
+    std::uint64_t sum=0;
+    std::uint64_t bound=ctx.y/n;
+    for(std::size_t i=b+1;i<=ctx.pi_y&&ctx.primes[i]<=bound;++i) {
+        std::uint64_t p=ctx.primes[i];
+        std::uint64_t phi=phi_tiny(xn/p,ctx.c);
+        sum+=mu_negative?phi:0-phi;
+        if(ctx.primes[i+1]<=bound/p) {
+            sum+=ordinary_leaves_from(ctx,xn/p,n*p,i,!mu_negative);
+        }
+    }
+    return sum;
+}
+
+std::uint64_t ordinary_leaves(const Context&ctx) {
+    std::atomic<std::size_t>next_b{ctx.c+1};
+    std::vector<std::uint64_t>partial(ctx.threads,0);
+    run_threads(ctx.threads,[&](unsigned t) {
+        std::uint64_t sum=0;
+        for(std::size_t b=next_b.fetch_add(1);b<=ctx.pi_y;b=next_b.fetch_add(1)) {
+            std::uint64_t p=ctx.primes[b];
+            sum-=phi_tiny(ctx.x/p,ctx.c);
+            if(ctx.primes[b+1]<=ctx.y/p) {
+                sum+=ordinary_leaves_from(ctx,ctx.x/p,p,b,true);
+            }
+        }
+        partial[t]=sum;
+    });
+    std::uint64_t sum=phi_tiny(ctx.x,ctx.c);
+    for(std::uint64_t s : partial) {
+        sum+=s;
+    }
+    return sum;
+}
+
+// Leaves phi(x/(p_b*p_l),b-1)=1 because x/(p_b*p_l)<p_b.
+std::uint64_t trivial_leaves(const Context&ctx) {
+    std::uint64_t sum=0;
+    for(std::size_t b=std::max<std::size_t>(ctx.c,ctx.pi_sqrtz)+1;b<ctx.pi_y;++b) {
+        std::uint64_t p=ctx.primes[b];
+        std::uint64_t bound=std::max(ctx.x/p/p,p);
+        if(bound<ctx.y) {
+            sum+=ctx.pi_y-ctx.pi[bound];
+        }
+    }
+    return sum;
+}
+
+// Leaves with p_b>sqrt(y) and y>x/(p_b*p_l)>=p_b, where
+// phi(x/(p_b*p_l),b-1)=pi(x/(p_b*p_l))-b+2. Above sqrt(x/p_b) consecutive
+// p_l share that value, so runs of them are counted at once.
+std::uint64_t easy_leaves(const Context&ctx) {
+    std::size_t first=std::max<std::size_t>(ctx.c,ctx.pi_sqrty)+1;
+    std::atomic<std::size_t>next_b{first};
+    std::vector<std::uint64_t>partial(ctx.threads,0);
+    run_threads(ctx.threads,[&](unsigned t) {
+        std::uint64_t sum=0;
+        for(std::size_t b=next_b.fetch_add(1);b<=ctx.pi_x13;b=next_b.fetch_add(1)) {
+            std::uint64_t p=ctx.primes[b];
+            std::uint64_t xp=ctx.x/p;
+            std::uint64_t min_trivial=std::min(xp/p,ctx.y);
+            std::uint64_t min_clustered=std::clamp(integer_sqrt(xp),p,ctx.y);
+            std::uint64_t min_sparse=std::clamp(ctx.z/p,p,ctx.y);
+            std::size_t l=static_cast<std::size_t>(ctx.pi[min_trivial]);
+            std::size_t pi_min_clustered=static_cast<std::size_t>(ctx.pi[min_clustered]);
+            std::size_t pi_min_sparse=static_cast<std::size_t>(ctx.pi[min_sparse]);
+            while(l>pi_min_clustered) {
+                std::uint64_t phi=ctx.pi[xp/ctx.primes[l]]-b+2;
+                std::uint64_t xm=xp/ctx.primes[b+phi-1];
+                std::size_t l2=std::max(static_cast<std::size_t>(ctx.pi[xm]),pi_min_clustered);
+                sum+=phi*(l-l2);
+                l=l2;
+            }
+            for(;l>pi_min_sparse;--l) {
+                sum+=ctx.pi[xp/ctx.primes[l]]-b+2;
+            }
+        }
+        partial[t]=sum;
+    });
+    std::uint64_t sum=0;
+    for(std::uint64_t s : partial) {
+        sum+=s;
+    }
+    return sum;
+}
+
+// Odd numbers of [low,high) (low even), one bit each, with a counter per
+// kCounterBits bits so prefix counts skip whole blocks.
+class LeafSieve {
+public:
+    void reset(std::uint64_t low,std::uint64_t high) {
+        low_=low;
+        bit_count_=static_cast<std::size_t>((high-low)/2);
+        std::size_t words=(bit_count_+63)/64;
+        bits_.assign(words,~0ULL);
+        if(bit_count_%64) {
+            bits_.back()=~0ULL>>(64-bit_count_%64);
+        }
+        counters_.assign((bit_count_+kCounterBits-1)/kCounterBits,static_cast<std::uint32_t>(kCounterBits));
+        if(bit_count_%kCounterBits) {
+            counters_.back()=static_cast<std::uint32_t>(bit_count_%kCounterBits);
+        }
+        total_=bit_count_;
+    }
+
+    std::uint64_t total() const { return total_;}
+
+    void begin_count() {
+        block_=0;
+        block_count_=0;
+    }
+
+    // Unsieved numbers in [low,v], for non-decreasing v since begin_count().
+    std::uint64_t count(std::uint64_t v) {
+        std::size_t end=static_cast<std::size_t>((v-low_+1)/2);
+        while((block_+1)*kCounterBits<=end) {
+            block_count_+=counters_[block_++];
+        }
+        std::uint64_t sum=block_count_;
+        std::size_t word=block_*kCounterBits/64;
+        for(;(word+1)*64<=end;++word) {
+            sum+=static_cast<std::uint64_t>(std::popcount(bits_[word]));
+        }
+        if(end%64) {
+            sum+=static_cast<std::uint64_t>(std::popcount(bits_[word]&(~0ULL>>(64-end%64))));
+        }
+        return sum;
+    }
+
+    // Crosses off the odd multiples of p from next, leaving next at the
+    // first one at or past the segment end.
+    void cross_off(std::uint64_t p,std::uint64_t&next) {
+        std::size_t i=static_cast<std::size_t>((next-low_)/2);
+        for(;i<bit_count_;i+=static_cast<std::size_t>(p)) {
+            std::uint64_t&word=bits_[i/64];
+            std::uint64_t bit=(word>>(i%64))&1ULL;
+            word&=~(1ULL<<(i%64));
+            counters_[i>>kCounterShift]-=static_cast<std::uint32_t>(bit);
+            total_-=bit;
+        }
+        next=low_+2*i+1;
+    }
+
+private:
+    std::uint64_t low_=0;
+    std::size_t bit_count_=0;
+    std::vector<std::uint64_t>bits_;
+    std::vector<std::uint32_t>counters_;
+    std::uint64_t total_=0;
+    std::size_t block_=0;
+    std::uint64_t block_count_=0;
+};
+
+// Hard leaves whose value falls in [low,high): sums use phi counts local to
+// the chunk, and mu_sum[b] records the leaf weight by which the count
+// before the chunk enters, so chunks run independently.
+struct HardChunk {
+    std::uint64_t low=0;
+    std::uint64_t high=0;
+    std::uint64_t sum=0;
+    std::vector<std::uint64_t>phi;
+    std::vector<std::uint64_t>mu_sum;
+};
+
+void hard_leaves_chunk(const Context&ctx,std::uint64_t segment_span,HardChunk&chunk,LeafSieve&sieve,std::vector<std::uint64_t>&next) {
+    std::size_t last_b=ctx.hard_b;
+    chunk.sum=0;
+    chunk.phi.assign(last_b+1,0);
+    chunk.mu_sum.assign(last_b+1,0);
+    next.resize(last_b+1);
+    for(std::size_t b=2;b<=last_b;++b) {
+        std::uint64_t p=ctx.primes[b];
+        std::uint64_t first=chunk.low<=p?p:(chunk.low+p-1)/p*p;
+        next[b]=(first&1ULL)?first:first+p;
+    }
+    std::size_t sqrty_end=std::min(ctx.pi_sqrty,last_b);
+    for(std::uint64_t low=chunk.low;low<chunk.high;low+=segment_span) {
+        std::uint64_t high=std::min(low+segment_span,chunk.high);
+        sieve.reset(low,high);
+        for(std::size_t b=2;b<=ctx.c;++b) {
+            sieve.cross_off(ctx.primes[b],next[b]);
+        }
+        std::size_t b=ctx.c+1;
+        // p_b<=sqrt(y): m runs over square-free numbers with lpf(m)>p_b.
+        for(;b<=sqrty_end;++b) {
+            std::uint64_t p=ctx.primes[b];
+            std::uint64_t xp=ctx.x/p;
+            std::uint64_t max_m=low==0?ctx.y:std::min(xp/low,ctx.y);
+            std::uint64_t min_m=std::max(xp/high,ctx.y/p);
+            if(p>=max_m) {
+                goto next_segment;
+            }
+            sieve.begin_count();
+            for(std::uint64_t m=(max_m&1ULL)?max_m:max_m-1;m>min_m;m-=2) {
+                std::int32_t entry=ctx.factors[static_cast<std::size_t>(m/2)];
+                if(entry==0||static_cast<std::uint64_t>(std::abs(entry))<=p) {
+                    continue;
+                }
+                std::uint64_t phi=chunk.phi[b]+sieve.count(xp/m);
+                if(entry>0) {
+                    chunk.sum-=phi;
+                    chunk.mu_sum[b]-=1;
+                } else {
+                    chunk.sum+=phi;
+                    chunk.mu_sum[b]+=1;
+                }
+            }
+            chunk.phi[b]+=sieve.total();
+            sieve.cross_off(p,next[b]);
+        }
+        // p_b>sqrt(y): m=p_l is prime, mu=-1.
+        for(;b<=last_b;++b) {
+            std::uint64_t p=ctx.primes[b];
+            std::uint64_t xp=ctx.x/p;
+            std::uint64_t max_m=std::min(ctx.z/p,ctx.y);
+            if(low!=0) {
+                max_m=std::min(max_m,xp/low);
+            }
+            std::uint64_t min_m=std::max(xp/high,p);
+            if(p>=max_m) {
+                goto next_segment;
+            }
+            sieve.begin_count();
+            std::size_t l=static_cast<std::size_t>(ctx.pi[max_m]);
+            std::uint64_t leaves=0;
+            for(;ctx.primes[l]>min_m;--l) {
+                chunk.sum+=chunk.phi[b]+sieve.count(xp/ctx.primes[l]);
+                ++leaves;
+            }
+            chunk.mu_sum[b]+=leaves;
+            chunk.phi[b]+=sieve.total();
+            sieve.cross_off(p,next[b]);
+        }
+    next_segment:;
+    }
+}
+
+std::uint64_t hard_leaves(const Context&ctx) {
+    std::uint64_t limit=ctx.z+1;
+    // About sqrt(z) numbers per segment, within cache-friendly bounds.
+    std::uint64_t span=std::bit_ceil(std::max<std::uint64_t>(integer_sqrt(limit),1));
+    span=std::clamp<std::uint64_t>(span,std::uint64_t{1}<<16,std::uint64_t{1}<<22);
+    std::uint64_t segments=(limit+span-1)/span;
+    unsigned threads=static_cast<unsigned>(std::clamp<std::uint64_t>(ctx.threads,1,segments));
+    // Leaves thin out as the values grow, so chunks double wave by wave
+    // while keeping enough waves to balance the threads.
+    std::uint64_t max_chunk=std::max<std::uint64_t>(1,segments/(threads*8ULL));
+    std::uint64_t chunk_segments=1;
+
+    std::vector<std::uint64_t>phi(ctx.hard_b+1,0);
+    std::uint64_t sum=0;
+    std::vector<HardChunk>chunks(threads);
+    std::vector<LeafSieve>sieves(threads);
+    std::vector<std::vector<std::uint64_t>>next(threads);
+    for(std::uint64_t low=0;low<limit;) {
+        for(unsigned t=0;t<threads;++t) {
+            chunks[t].low=std::min(limit,low+t*chunk_segments*span);
+            chunks[t].high=std::min(limit,chunks[t].low+chunk_segments*span);
+        }
+        run_threads(threads,[&](unsigned t) {
+            if(chunks[t].low<chunks[t].high) {
+                hard_leaves_chunk(ctx,span,chunks[t],sieves[t],next[t]);
+            }
+        });
+        for(const HardChunk&chunk : chunks) {
+            if(chunk.low>=chunk.high) {
+                continue;
+            }
+            sum+=chunk.sum;
+            for(std::size_t b=ctx.c+1;b<=ctx.hard_b;++b) {
+                sum+=chunk.mu_sum[b]*phi[b];
+                phi[b]+=chunk.phi[b];
+            }
+        }
+        low=chunks[threads-1].high;
+        chunk_segments=std::min(chunk_segments*2,max_chunk);
+    }
+    return sum;
+}
+
+// P2(x,y): numbers up to x with exactly two prime factors, both above y,
+// as the sum of pi(x/p)-pi(p)+1 over y<p<=sqrt(x). The values x/p fill
+// [sqrt(x),x/y], which is sieved in contiguous blocks per thread; each
+// block counts from its own start and the offsets are added in order.
+std::uint64_t p2(const Context&ctx,const BasePrimes&base) {
+    std::uint64_t x=ctx.x;
+    std::uint64_t sqrtx=integer_sqrt(x);
+    if(ctx.y>=sqrtx) {
+        return 0;
+    }
+    std::uint64_t begin=std::max<std::uint64_t>(3,sqrtx|1ULL);
+    std::uint64_t end=ctx.z+1;
+    if((end&1ULL)==0) {
+        ++end;
+    }
+    CpuInfo info=detect_cpu_info();
+    SieveRange range{begin,end};
+    SegmentConfig config=choose_segment_config(info,ctx.threads,0,0,end-begin,SieveLayout::OddBits);
+    unsigned threads=static_cast<unsigned>(std::max<std::size_t>(1,std::min<std::size_t>(ctx.threads,SegmentWorkQueue(range,config).segment_count())));
+    SegmentWorkQueue queue(range,config,SegmentSchedule::Contiguous,threads);
+    const Wheel&wheel=get_wheel(WheelType::Mod30);
+    PrimeMarker marker(wheel,config,begin,end,base,wheel.small_prime_limit,threads);
+
+    struct BlockSums {
+        std::uint64_t sum=0;
+        std::uint64_t leaves=0;
+        std::uint64_t primes=0;
+    };
+    std::vector<BlockSums>blocks(threads);
+    run_threads(threads,[&](unsigned t) {
+        auto state=marker.make_thread_state(queue.first_segment(t));
+        std::vector<std::uint64_t>bitset;
+        std::vector<std::uint64_t>values;
+        SegmentCounts counts;
+        BlockSums block;
+        std::uint64_t segment_id=0;
+        std::uint64_t low=0;
+        std::uint64_t high=0;
+        while(queue.next(t,segment_id,low,high)) {
+            marker.sieve_segment(state,segment_id,low,high,bitset,&counts);
+            // x/p in [low,high) for x/high<p<=x/low.
+            std::uint64_t p_low=std::max(x/high+1,ctx.y+1);
+            std::uint64_t p_high=std::min(x/low,sqrtx);
+            values.clear();
+            if(p_low<=p_high) {
+                BasePrimes::Reader it=base.reader(base.lower_bound(p_low));
+                for(std::uint64_t p=it.next();p!=0&&p<=p_high;p=it.next()) {
+                    values.push_back(x/p);
+                }
+            }
+            // Ascending values, each counted on from the previous one.
+            std::size_t word=0;
+            std::uint64_t zeros=0;
+            for(auto v=values.rbegin();v!=values.rend();++v) {
+                std::size_t end_bit=static_cast<std::size_t>((*v-low)/2+1);
+                for(;(word+1)*64<=end_bit;++word) {
+                    zeros+=64-static_cast<std::uint64_t>(std::popcount(bitset[word]));
+                }
+                std::uint64_t count=zeros;
+                if(end_bit%64) {
+                    std::uint64_t mask=~0ULL>>(64-end_bit%64);
+                    count+=static_cast<std::uint64_t>(std::popcount(~bitset[word]&mask));
+                }
+                block.sum+=block.primes+count;
+            }
+            block.leaves+=values.size();
+            block.primes+=counts.total;
+        }
+        blocks[t]=block;
+    });
+
+    // Primes below begin: 2 and the odd ones.
+    std::uint64_t before=base.lower_bound(begin)+1;
+    std::uint64_t sum=0;
+    for(const BlockSums&block : blocks) {
+        sum+=block.sum+before*block.leaves;
+        before+=block.primes;
+    }
+    // Minus the sum of pi(p)-1=b-1 over a<b<=pi(sqrt(x)).
+    std::uint64_t a=ctx.pi_y;
+    std::uint64_t b=base.lower_bound(sqrtx+1)+1;
+    sum-=(b*(b-1)-a*(a-1))/2;
+    return sum;
+}
+
+}
+
+std::uint64_t deleglise_rivat_pi(std::uint64_t x,const BasePrimes&primes,unsigned threads) {
+    if(threads==0) {
+        threads=std::thread::hardware_concurrency();
+    }
+    threads=std::max(threads,1u);
+    if(x<kDirectLimit) {
+        return x<2?0:generate_base_primes(x,threads).size()+1;
+    }
+    Context ctx=make_context(x,primes,threads);
+    std::uint64_t phi=ordinary_leaves(ctx)+trivial_leaves(ctx)+easy_leaves(ctx)+hard_leaves(ctx);
+    return phi+ctx.pi_y-1-p2(ctx,primes);
+}
+
+std::uint64_t deleglise_rivat_count(std::uint64_t from,std::uint64_t to,const BasePrimes&primes,unsigned threads) {
+    if(to<=from) {
+        return 0;
+    }
+    std::uint64_t upper=deleglise_rivat_pi(to-1,primes,threads);
+    std::uint64_t lower=from==0?0:deleglise_rivat_pi(from-1,primes,threads);
+    return upper-lower;
+}
+
+CountMethod choose_count_method(CountMethod mode,std::uint64_t from,std::uint64_t to,const SegmentConfig&config) {
+    if(mode!=CountMethod::Auto) {
+        return mode;
+    }
+    // Below kDirectLimit the analytic path is a plain sieve itself.
+    if(to<=from||to-1<kDirectLimit) {
+        return CountMethod::Sieve;
+    }
+    double length=static_cast<double>(to-from);
+    double sieve_cost=length*kSieveNsPerNumber;
+    // Primes above half a segment span go to the buckets; those up to
+    // sqrt(to) hit the range length/p times, about
+    // length*ln(ln(sqrt(to))/ln(span/2)) in all.
+    double root=std::sqrt(static_cast<double>(to-1));
+    double large_threshold=static_cast<double>(config.segment_span/2);
+    if(large_threshold>2.0&&root>large_threshold) {
+        sieve_cost+=length*kSieveNsPerLargeHit*std::log(std::log(root)/std::log(large_threshold));
+    }
+    double analytic=analytic_cost(to-1)+(from>1?analytic_cost(from-1):0.0);
+    return analytic<sieve_cost?CountMethod::Analytic:CountMethod::Sieve;
+}
+
+const char*count_method_name(CountMethod method) {
+    switch(method) {
+    case CountMethod::Sieve:
+        return "sieve";
+    case CountMethod::Analytic:
+        return "analytic";
+    case CountMethod::Auto:
+        break;
+    }
+    return "auto";
+}
+
+}
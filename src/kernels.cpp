@@ -0,0 +1,151 @@
+#include "kernels.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(CALCPRIME_X86_KERNELS)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace calcprime {
+namespace {
+
+#if defined(CALCPRIME_X86_KERNELS)
+
+struct CpuidRegs {
+    unsigned eax;
+    unsigned ebx;
+    unsigned ecx;
+    unsigned edx;
+};
+
+CpuidRegs cpuid(unsigned leaf,unsigned subleaf) {
+    CpuidRegs regs{};
+#if defined(_MSC_VER)
+    int out[4];
+    __cpuidex(out,static_cast<int>(leaf),static_cast<int>(subleaf));
+    regs.eax=static_cast<unsigned>(out[0]);
+    regs.ebx=static_cast<unsigned>(out[1]);
+    regs.ecx=static_cast<unsigned>(out[2]);
+    regs.edx=static_cast<unsigned>(out[3]);
+#else
+    __cpuid_count(leaf,subleaf,regs.eax,regs.ebx,regs.ecx,regs.edx);
+#endif
+    return regs;
+}
+
+std::uint64_t read_xcr0() {
+#if defined(_MSC_VER)
+    return static_cast<std::uint64_t>(_xgetbv(0));
+#else
+    unsigned lo=0;
+    unsigned hi=0;
+    __asm__ volatile("xgetbv" : "=a"(lo),"=d"(hi) : "c"(0));
+    return (static_cast<std::uint64_t>(hi)<<32)|lo;
+#endif
+}
+
+// Highest tier the CPU and the OS both support. AVX2 kernels also use
+// POPCNT and BMI1/2; the AVX-512 tier needs F, BW, VL and VPOPCNTDQ and
+// the OS saving the opmask and ZMM state.
+KernelIsa detect_isa() {
+    if(cpuid(0,0).eax<7) {
+        return KernelIsa::Scalar;
+    }
+    CpuidRegs basic=cpuid(1,0);
+    bool osxsave=(basic.ecx>>27)&1u;
+    bool avx=(basic.ecx>>28)&1u;
+    bool popcnt=(basic.ecx>>23)&1u;
+    if(!osxsave||!avx||!popcnt) {
+        return KernelIsa::Scalar;
+    }
+    std::uint64_t xcr0=read_xcr0();
+    if((xcr0&0x6)!=0x6) {
+        return KernelIsa::Scalar;
+    }
+    CpuidRegs ext=cpuid(7,0);
+    bool avx2=(ext.ebx>>5)&1u;
+    bool bmi1=(ext.ebx>>3)&1u;
+    bool bmi2=(ext.ebx>>8)&1u;
+    if(!avx2||!bmi1||!bmi2) {
+        return KernelIsa::Scalar;
+    }
+    bool avx512f=(ext.ebx>>16)&1u;
+    bool avx512bw=(ext.ebx>>30)&1u;
+    bool avx512vl=(ext.ebx>>31)&1u;
+    bool vpopcntdq=(ext.ecx>>14)&1u;
+    if(avx512f&&avx512bw&&avx512vl&&vpopcntdq&&(xcr0&0xE6)==0xE6) {
+        return KernelIsa::Avx512;
+    }
+    return KernelIsa::Avx2;
+}
+
+#else
+
+KernelIsa detect_isa() {
+    return KernelIsa::Scalar;
+}
+
+#endif
+
+const KernelTable*table_for(KernelIsa isa) {
+    switch(isa) {
+    case KernelIsa::Avx512:
+        return avx512_kernels();
+    case KernelIsa::Avx2:
+        return avx2_kernels();
+    case KernelIsa::Scalar:
+        break;
+    }
+    return&scalar_kernels();
+}
+
+const KernelTable&select_kernels() {
+    KernelIsa isa=detect_isa();
+    // CALCPRIME_ISA can only lower the tier; asking for more than the CPU
+    // has, or for an unknown name, keeps the detected one.
+    if(const char*env=std::getenv("CALCPRIME_ISA")) {
+        KernelIsa requested=isa;
+        if(std::strcmp(env,"scalar")==0) {
+            requested=KernelIsa::Scalar;
+        } else if(std::strcmp(env,"avx2")==0) {
+            requested=KernelIsa::Avx2;
+        } else if(std::strcmp(env,"avx512")==0) {
+            requested=KernelIsa::Avx512;
+        }
+        if(static_cast<int>(requested)<static_cast<int>(isa)) {
+            isa=requested;
+        }
+    }
+    const KernelTable*table=table_for(isa);
+    while(!table) {
+        isa=static_cast<KernelIsa>(static_cast<int>(isa)-1);
+        table=table_for(isa);
+    }
+    return*table;
+}
+
+}
+
+const KernelTable&active_kernels() {
+    static const KernelTable&table=select_kernels();
+    return table;
+}
+
+const char*kernel_isa_name(KernelIsa isa) {
+    switch(isa) {
+    case KernelIsa::Avx512:
+        return "avx512";
+    case KernelIsa::Avx2:
+        return "avx2";
+    case KernelIsa::Scalar:
+        break;
+    }
+    return "scalar";
+}
+
+}
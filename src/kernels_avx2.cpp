@@ -0,0 +1,325 @@
+#include "kernels.h"
+
+#if defined(CALCPRIME_X86_KERNELS)
+
+#include "wheel.h"
+
+#include <array>
+#include <bit>
+#include <immintrin.h>
+
+namespace calcprime {
+namespace {
+
+std::uint64_t count_zero_bits_avx2(const std::uint64_t*bits,std::size_t bit_count) {
+    std::size_t full_words=bit_count/64;
+    std::size_t rem_bits=bit_count%64;
+    const __m256i low_mask=_mm256_set1_epi8(0x0F);
+    const __m256i nibble_popcnt=_mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i zero=_mm256_setzero_si256();
+    __m256i sums=_mm256_setzero_si256();
+    std::size_t i=0;
+    for(;i+4<=full_words;i+=4) {
+        __m256i data=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bits+i));
+        __m256i lo=_mm256_and_si256(data,low_mask);
+        __m256i hi=_mm256_and_si256(_mm256_srli_epi16(data,4),low_mask);
+        __m256i popcnt=_mm256_add_epi8(_mm256_shuffle_epi8(nibble_popcnt,lo),
+            _mm256_shuffle_epi8(nibble_popcnt,hi));
+        sums=_mm256_add_epi64(sums,_mm256_sad_epu8(popcnt,zero));
+    }
+    alignas(32) std::array<std::uint64_t,4>buf;
+    _mm256_store_si256(reinterpret_cast<__m256i*>(buf.data()),sums);
+    std::uint64_t ones=buf[0]+buf[1]+buf[2]+buf[3];
+    for(;i<full_words;++i) {
+        ones+=static_cast<std::uint64_t>(_mm_popcnt_u64(bits[i]));
+    }
+    std::uint64_t total=full_words*64-ones;
+    if(rem_bits) {
+        std::uint64_t mask=(1ULL<<rem_bits)-1;
+        total+=rem_bits-static_cast<std::uint64_t>(_mm_popcnt_u64(bits[full_words]&mask));
+    }
+    return total;
+}
+
+void shift_copy_avx2(std::uint64_t*dst,const std::uint64_t*src,std::size_t word_count,unsigned shift) {
+    const __m128i right=_mm_cvtsi32_si128(static_cast<int>(shift));
+    const __m128i left=_mm_cvtsi32_si128(static_cast<int>(64-shift));
+    std::size_t i=0;
+    for(;i+4<=word_count;i+=4) {
+        __m256i lo=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i));
+        __m256i hi=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i+1));
+        __m256i out=_mm256_or_si256(_mm256_srl_epi64(lo,right),_mm256_sll_epi64(hi,left));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+i),out);
+    }
+    for(;i<word_count;++i) {
+        dst[i]=(src[i]>>shift)|(src[i+1]<<(64-shift));
+    }
+}
+
+void or_small_streams_avx2(std::uint64_t*words,std::size_t word_count,const std::uint64_t*const*streams,const std::uint32_t*periods,std::uint32_t*cursors) {
+    const std::uint64_t*s0=streams[0];
+    const std::uint64_t*s1=streams[1];
+    const std::uint64_t*s2=streams[2];
+    const std::uint64_t*s3=streams[3];
+    std::uint32_t c[kSmallStreamGroup]={cursors[0],cursors[1],cursors[2],cursors[3]};
+    auto advance=[periods,&c](std::uint32_t step) {
+        for(std::size_t k=0;k<kSmallStreamGroup;++k) {
+            c[k]+=step;
+            c[k]-=c[k]>=periods[k]?periods[k]:0;
+        }
+    };
+    std::size_t w=0;
+    for(;w+4<=word_count;w+=4) {
+        __m256i acc=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(words+w));
+        __m256i a=_mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s0+c[0])),
+                                  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s1+c[1])));
+        __m256i b=_mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s2+c[2])),
+                                  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s3+c[3])));
+        acc=_mm256_or_si256(acc,_mm256_or_si256(a,b));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(words+w),acc);
+        advance(4);
+    }
+    for(;w<word_count;++w) {
+        words[w]|=s0[c[0]]|s1[c[1]]|s2[c[2]]|s3[c[3]];
+        advance(1);
+    }
+    for(std::size_t k=0;k<kSmallStreamGroup;++k) {
+        cursors[k]=c[k];
+    }
+}
+
+// Extraction is branch-free per byte: a table lists the positions of the
+// clear bits of each byte value, eight lanes are widened and offset, and a
+// masked store writes exactly popcount of them.
+struct ByteLanes {
+    std::array<std::uint64_t,256>odd;
+    std::array<std::uint64_t,256>wheel30;
+};
+
+constexpr ByteLanes make_byte_lanes() {
+    ByteLanes lanes{};
+    for(unsigned value=0;value<256;++value) {
+        unsigned live=~value&0xFFu;
+        std::uint64_t odd=0;
+        std::uint64_t wheel30=0;
+        unsigned slot=0;
+        for(unsigned b=0;b<8;++b) {
+            if(live&(1u<<b)) {
+                odd|=static_cast<std::uint64_t>(2*b)<<(8*slot);
+                wheel30|=static_cast<std::uint64_t>(kWheel30Residues[b])<<(8*slot);
+                ++slot;
+            }
+        }
+        lanes.odd[value]=odd;
+        lanes.wheel30[value]=wheel30;
+    }
+    return lanes;
+}
+
+constexpr ByteLanes kByteLanes=make_byte_lanes();
+
+inline std::uint64_t*store_byte_lanes(std::uint64_t*out,std::uint64_t offsets,unsigned count,__m256i base) {
+    const __m256i low_lanes=_mm256_setr_epi64x(0,1,2,3);
+    const __m256i high_lanes=_mm256_setr_epi64x(4,5,6,7);
+    __m128i packed=_mm_cvtsi64_si128(static_cast<long long>(offsets));
+    __m256i lo=_mm256_add_epi64(base,_mm256_cvtepu8_epi64(packed));
+    __m256i hi=_mm256_add_epi64(base,_mm256_cvtepu8_epi64(_mm_srli_si128(packed,4)));
+    __m256i n=_mm256_set1_epi64x(count);
+    _mm256_maskstore_epi64(reinterpret_cast<long long*>(out),_mm256_cmpgt_epi64(n,low_lanes),lo);
+    _mm256_maskstore_epi64(reinterpret_cast<long long*>(out+4),_mm256_cmpgt_epi64(n,high_lanes),hi);
+    return out+count;
+}
+
+std::size_t extract_odd_bits_avx2(const std::uint64_t*bits,std::size_t bit_count,std::uint64_t low,std::uint64_t*out) {
+    std::uint64_t*start=out;
+    std::size_t word_count=(bit_count+63)/64;
+    for(std::size_t w=0;w<word_count;++w) {
+        std::uint64_t composite=bits[w];
+        if(w+1==word_count&&bit_count%64!=0) {
+            composite|=~((1ULL<<(bit_count%64))-1);
+        }
+        std::uint64_t base=low+128ULL*w;
+        for(unsigned j=0;j<8;++j) {
+            unsigned value=static_cast<unsigned>(composite>>(8*j))&0xFFu;
+            unsigned count=8-static_cast<unsigned>(_mm_popcnt_u32(value));
+            out=store_byte_lanes(out,kByteLanes.odd[value],count,_mm256_set1_epi64x(static_cast<long long>(base+16ULL*j)));
+        }
+    }
+    return static_cast<std::size_t>(out-start);
+}
+
+std::size_t extract_wheel30_bytes_avx2(const std::uint8_t*bytes,std::size_t byte_count,std::uint64_t low,std::uint64_t*out) {
+    std::uint64_t*start=out;
+    for(std::size_t k=0;k<byte_count;++k) {
+        unsigned value=bytes[k];
+        unsigned count=8-static_cast<unsigned>(_mm_popcnt_u32(value));
+        out=store_byte_lanes(out,kByteLanes.wheel30[value],count,_mm256_set1_epi64x(static_cast<long long>(low+30ULL*k)));
+    }
+    return static_cast<std::size_t>(out-start);
+}
+
+// Products of a 64-bit lane and a 32-bit prime, modulo 2^64.
+inline __m256i mul_u64_u32(__m256i a,__m256i p) {
+    __m256i lo=_mm256_mul_epu32(a,p);
+    __m256i hi=_mm256_mul_epu32(_mm256_srli_epi64(a,32),p);
+    return _mm256_add_epi64(lo,_mm256_slli_epi64(hi,32));
+}
+
+// Integers below 2^52 convert to and from double by adding 2^52 and
+// reinterpreting the bits.
+inline __m256i floor_to_u64(__m256d x,__m256d magic) {
+    return _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(_mm256_floor_pd(x),magic)),_mm256_castpd_si256(magic));
+}
+
+// The quotient estimate from a double division is within two of start/p,
+// so two corrections on each side make it exact; m%30 is found the same way.
+void first_wheel30_hits_avx2(const std::uint32_t*primes,std::size_t count,std::uint64_t start,std::uint64_t*distances,std::uint32_t*wheel_indices) {
+    const __m256d magic=_mm256_set1_pd(4503599627370496.0);
+    const __m256i magic_bits=_mm256_castpd_si256(magic);
+    const __m256d start_d=_mm256_set1_pd(static_cast<double>(start));
+    const __m256i start_v=_mm256_set1_epi64x(static_cast<long long>(start));
+    const __m256d inv30=_mm256_set1_pd(1.0/30.0);
+    const __m256i thirty=_mm256_set1_epi64x(30);
+    const __m256i zero=_mm256_setzero_si256();
+    const __m256i ones=_mm256_set1_epi64x(-1);
+    const __m256i low_byte=_mm256_set1_epi64x(0xFF);
+    const __m256i even_lanes=_mm256_setr_epi32(0,2,4,6,0,2,4,6);
+    std::size_t i=0;
+    for(;i+4<=count;i+=4) {
+        __m256i p=_mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(primes+i)));
+        __m256d pd=_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(p,magic_bits)),magic);
+        __m256i q=floor_to_u64(_mm256_div_pd(start_d,pd),magic);
+        __m256i r=_mm256_sub_epi64(start_v,mul_u64_u32(q,p));
+        for(int round=0;round<2;++round) {
+            __m256i negative=_mm256_cmpgt_epi64(zero,r);
+            q=_mm256_add_epi64(q,negative);
+            r=_mm256_add_epi64(r,_mm256_and_si256(negative,p));
+        }
+        for(int round=0;round<2;++round) {
+            __m256i reached=_mm256_andnot_si256(_mm256_cmpgt_epi64(p,r),ones);
+            q=_mm256_sub_epi64(q,reached);
+            r=_mm256_sub_epi64(r,_mm256_and_si256(reached,p));
+        }
+        __m256i m=_mm256_sub_epi64(q,_mm256_andnot_si256(_mm256_cmpeq_epi64(r,zero),ones));
+        m=_mm256_blendv_epi8(m,p,_mm256_cmpgt_epi64(p,m));
+        __m256d md=_mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(m,magic_bits)),magic);
+        __m256i k=floor_to_u64(_mm256_mul_pd(md,inv30),magic);
+        __m256i residue=_mm256_sub_epi64(m,_mm256_sub_epi64(_mm256_slli_epi64(k,5),_mm256_slli_epi64(k,1)));
+        residue=_mm256_add_epi64(residue,_mm256_and_si256(_mm256_cmpgt_epi64(zero,residue),thirty));
+        residue=_mm256_sub_epi64(residue,_mm256_andnot_si256(_mm256_cmpgt_epi64(thirty,residue),thirty));
+        __m256i advance=_mm256_i64gather_epi64(reinterpret_cast<const long long*>(kWheel30Advance.data()),residue,8);
+        m=_mm256_add_epi64(m,_mm256_and_si256(advance,low_byte));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(distances+i),_mm256_sub_epi64(mul_u64_u32(m,p),start_v));
+        __m256i wheel=_mm256_permutevar8x32_epi32(_mm256_srli_epi64(advance,8),even_lanes);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(wheel_indices+i),_mm256_castsi256_si128(wheel));
+    }
+    scalar_kernels().first_wheel30_hits(primes+i,count-i,start,distances+i,wheel_indices+i);
+}
+
+// 64x64-bit products from four 32x32 multiplies per lane.
+inline __m256i mul_high_u64x4(__m256i a,__m256i b) {
+    const __m256i low32=_mm256_set1_epi64x(0xFFFFFFFF);
+    __m256i a_hi=_mm256_srli_epi64(a,32);
+    __m256i b_hi=_mm256_srli_epi64(b,32);
+    __m256i ll=_mm256_mul_epu32(a,b);
+    __m256i lh=_mm256_mul_epu32(a,b_hi);
+    __m256i hl=_mm256_mul_epu32(a_hi,b);
+    __m256i hh=_mm256_mul_epu32(a_hi,b_hi);
+    __m256i mid=_mm256_add_epi64(_mm256_add_epi64(_mm256_srli_epi64(ll,32),_mm256_and_si256(lh,low32)),_mm256_and_si256(hl,low32));
+    return _mm256_add_epi64(_mm256_add_epi64(hh,_mm256_srli_epi64(lh,32)),_mm256_add_epi64(_mm256_srli_epi64(hl,32),_mm256_srli_epi64(mid,32)));
+}
+
+inline __m256i mul_low_u64x4(__m256i a,__m256i b) {
+    __m256i cross=_mm256_add_epi64(_mm256_mul_epu32(a,_mm256_srli_epi64(b,32)),_mm256_mul_epu32(_mm256_srli_epi64(a,32),b));
+    return _mm256_add_epi64(_mm256_mul_epu32(a,b),_mm256_slli_epi64(cross,32));
+}
+
+// a<b as unsigned 64-bit lanes.
+inline __m256i less_u64x4(__m256i a,__m256i b) {
+    const __m256i sign=_mm256_set1_epi64x(static_cast<long long>(1ULL<<63));
+    return _mm256_cmpgt_epi64(_mm256_xor_si256(b,sign),_mm256_xor_si256(a,sign));
+}
+
+inline __m256i montgomery_mul_x4(__m256i a,__m256i b,__m256i n,__m256i n_inv) {
+    __m256i t=mul_high_u64x4(mul_low_u64x4(mul_low_u64x4(a,b),n_inv),n);
+    __m256i high=mul_high_u64x4(a,b);
+    __m256i x=_mm256_sub_epi64(high,t);
+    return _mm256_add_epi64(x,_mm256_and_si256(less_u64x4(high,t),n));
+}
+
+// The scalar round on four moduli at once, as in the AVX-512 kernel.
+void strong_probable_primes_avx2(const std::uint64_t*n,const std::uint64_t*one,const std::uint64_t*bases,std::size_t count,std::uint8_t*pass) {
+    const __m256i two=_mm256_set1_epi64x(2);
+    const __m256i zero=_mm256_setzero_si256();
+    std::size_t i=0;
+    for(;i+4<=count;i+=4) {
+        __m256i modulus=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(n+i));
+        __m256i unit=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(one+i));
+        __m256i base=bases?_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bases+i)):zero;
+        __m256i n_inv=modulus;
+        for(int k=0;k<5;++k) {
+            n_inv=mul_low_u64x4(n_inv,_mm256_sub_epi64(two,mul_low_u64x4(modulus,n_inv)));
+        }
+        __m256i exponent=_mm256_sub_epi64(modulus,_mm256_set1_epi64x(1));
+        __m256i minus_one=_mm256_sub_epi64(modulus,unit);
+        alignas(32) std::array<std::uint64_t,4>lanes;
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes.data()),exponent);
+        int top=63-std::countl_zero(lanes[0]|lanes[1]|lanes[2]|lanes[3]);
+        __m256i x=unit;
+        __m256i ok=zero;
+        for(int j=top;j>=1&&_mm256_movemask_pd(_mm256_castsi256_pd(ok))!=0xF;--j) {
+            x=montgomery_mul_x4(x,x,modulus,n_inv);
+            __m256i set=_mm256_cmpeq_epi64(_mm256_and_si256(exponent,_mm256_set1_epi64x(static_cast<long long>(1ULL<<j))),zero);
+            set=_mm256_xor_si256(set,_mm256_set1_epi64x(-1));
+            __m256i stepped;
+            if(bases) {
+                stepped=montgomery_mul_x4(x,base,modulus,n_inv);
+            } else {
+                __m256i gap=_mm256_sub_epi64(modulus,x);
+                __m256i wrap=_mm256_xor_si256(less_u64x4(x,gap),_mm256_set1_epi64x(-1));
+                stepped=_mm256_sub_epi64(_mm256_add_epi64(x,x),_mm256_and_si256(wrap,modulus));
+            }
+            x=_mm256_blendv_epi8(x,stepped,set);
+            // Lanes with j<=ctz(n-1), i.e. no set bit below j.
+            __m256i tail=_mm256_cmpeq_epi64(_mm256_and_si256(exponent,_mm256_set1_epi64x(static_cast<long long>((1ULL<<j)-1))),zero);
+            __m256i hit=_mm256_or_si256(_mm256_cmpeq_epi64(x,minus_one),_mm256_and_si256(set,_mm256_cmpeq_epi64(x,unit)));
+            ok=_mm256_or_si256(ok,_mm256_and_si256(tail,hit));
+        }
+        int mask=_mm256_movemask_pd(_mm256_castsi256_pd(ok));
+        for(int k=0;k<4;++k) {
+            pass[i+k]=static_cast<std::uint8_t>((mask>>k)&1);
+        }
+    }
+    scalar_kernels().strong_probable_primes(n+i,one+i,bases?bases+i:nullptr,count-i,pass+i);
+}
+
+}
+
+const KernelTable*avx2_kernels() {
+    static const KernelTable table{
+        KernelIsa::Avx2,
+        count_zero_bits_avx2,
+        shift_copy_avx2,
+        or_small_streams_avx2,
+        extract_odd_bits_avx2,
+        extract_wheel30_bytes_avx2,
+        first_wheel30_hits_avx2,
+        strong_probable_primes_avx2,
+    };
+    return&table;
+}
+
+}
+
+#else
+
+namespace calcprime {
+
+const KernelTable*avx2_kernels() {
+    return nullptr;
+}
+
+}
+
+#endif
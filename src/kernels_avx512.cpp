@@ -0,0 +1,276 @@
+#include "kernels.h"
+
+#if defined(CALCPRIME_X86_KERNELS)
+
+#include "wheel.h"
+
+#include <bit>
+#include <immintrin.h>
+
+namespace calcprime {
+namespace {
+
+std::uint64_t count_zero_bits_avx512(const std::uint64_t*bits,std::size_t bit_count) {
+    std::size_t full_words=bit_count/64;
+    std::size_t rem_bits=bit_count%64;
+    __m512i sums=_mm512_setzero_si512();
+    std::size_t i=0;
+    for(;i+8<=full_words;i+=8) {
+        __m512i data=_mm512_loadu_si512(reinterpret_cast<const void*>(bits+i));
+        sums=_mm512_add_epi64(sums,_mm512_popcnt_epi64(data));
+    }
+    if(i<full_words) {
+        __mmask8 tail=static_cast<__mmask8>((1u<<(full_words-i))-1);
+        __m512i data=_mm512_maskz_loadu_epi64(tail,bits+i);
+        sums=_mm512_add_epi64(sums,_mm512_popcnt_epi64(data));
+    }
+    std::uint64_t total=full_words*64-static_cast<std::uint64_t>(_mm512_reduce_add_epi64(sums));
+    if(rem_bits) {
+        std::uint64_t mask=(1ULL<<rem_bits)-1;
+        total+=rem_bits-static_cast<std::uint64_t>(_mm_popcnt_u64(bits[full_words]&mask));
+    }
+    return total;
+}
+
+void shift_copy_avx512(std::uint64_t*dst,const std::uint64_t*src,std::size_t word_count,unsigned shift) {
+    const __m512i right=_mm512_set1_epi64(shift);
+    const __m512i left=_mm512_set1_epi64(64-shift);
+    std::size_t i=0;
+    for(;i+8<=word_count;i+=8) {
+        __m512i lo=_mm512_loadu_si512(reinterpret_cast<const void*>(src+i));
+        __m512i hi=_mm512_loadu_si512(reinterpret_cast<const void*>(src+i+1));
+        __m512i out=_mm512_or_si512(_mm512_srlv_epi64(lo,right),_mm512_sllv_epi64(hi,left));
+        _mm512_storeu_si512(reinterpret_cast<void*>(dst+i),out);
+    }
+    for(;i<word_count;++i) {
+        dst[i]=(src[i]>>shift)|(src[i+1]<<(64-shift));
+    }
+}
+
+void or_small_streams_avx512(std::uint64_t*words,std::size_t word_count,const std::uint64_t*const*streams,const std::uint32_t*periods,std::uint32_t*cursors) {
+    const std::uint64_t*s0=streams[0];
+    const std::uint64_t*s1=streams[1];
+    const std::uint64_t*s2=streams[2];
+    const std::uint64_t*s3=streams[3];
+    std::uint32_t c[kSmallStreamGroup]={cursors[0],cursors[1],cursors[2],cursors[3]};
+    // Steps of 8 words need every period above 8; the smallest pattern
+    // prime is 23 and the zero stream has period 8.
+    auto advance=[periods,&c](std::uint32_t step) {
+        for(std::size_t k=0;k<kSmallStreamGroup;++k) {
+            c[k]+=step;
+            c[k]-=c[k]>=periods[k]?periods[k]:0;
+        }
+    };
+    std::size_t w=0;
+    for(;w+8<=word_count;w+=8) {
+        __m512i acc=_mm512_loadu_si512(reinterpret_cast<const void*>(words+w));
+        __m512i a=_mm512_loadu_si512(reinterpret_cast<const void*>(s0+c[0]));
+        __m512i b=_mm512_loadu_si512(reinterpret_cast<const void*>(s1+c[1]));
+        __m512i d=_mm512_loadu_si512(reinterpret_cast<const void*>(s2+c[2]));
+        // Truth table 0xFE is the three-input OR.
+        acc=_mm512_ternarylogic_epi64(acc,a,b,0xFE);
+        acc=_mm512_ternarylogic_epi64(acc,d,_mm512_loadu_si512(reinterpret_cast<const void*>(s3+c[3])),0xFE);
+        _mm512_storeu_si512(reinterpret_cast<void*>(words+w),acc);
+        advance(8);
+    }
+    for(;w<word_count;++w) {
+        words[w]|=s0[c[0]]|s1[c[1]]|s2[c[2]]|s3[c[3]];
+        advance(1);
+    }
+    for(std::size_t k=0;k<kSmallStreamGroup;++k) {
+        cursors[k]=c[k];
+    }
+}
+
+// Extraction compresses one byte of candidates at a time: the byte's clear
+// bits select lanes of an 8-value vector, and a masked store writes exactly
+// popcount(byte) primes, so the output needs no slack past the count.
+std::size_t extract_odd_bits_avx512(const std::uint64_t*bits,std::size_t bit_count,std::uint64_t low,std::uint64_t*out) {
+    std::uint64_t*start=out;
+    const __m512i byte_step=_mm512_set1_epi64(16);
+    __m512i values=_mm512_add_epi64(_mm512_set1_epi64(static_cast<long long>(low)),
+                                    _mm512_setr_epi64(0,2,4,6,8,10,12,14));
+    std::size_t word_count=(bit_count+63)/64;
+    for(std::size_t w=0;w<word_count;++w) {
+        std::uint64_t live=~bits[w];
+        if(w+1==word_count&&bit_count%64!=0) {
+            live&=(1ULL<<(bit_count%64))-1;
+        }
+        for(unsigned j=0;j<8;++j) {
+            __mmask8 lanes=static_cast<__mmask8>(live>>(8*j));
+            unsigned n=static_cast<unsigned>(_mm_popcnt_u32(lanes));
+            __m512i packed=_mm512_maskz_compress_epi64(lanes,values);
+            _mm512_mask_storeu_epi64(out,static_cast<__mmask8>((1u<<n)-1),packed);
+            out+=n;
+            values=_mm512_add_epi64(values,byte_step);
+        }
+    }
+    return static_cast<std::size_t>(out-start);
+}
+
+std::size_t extract_wheel30_bytes_avx512(const std::uint8_t*bytes,std::size_t byte_count,std::uint64_t low,std::uint64_t*out) {
+    std::uint64_t*start=out;
+    const __m512i byte_step=_mm512_set1_epi64(30);
+    __m512i values=_mm512_add_epi64(_mm512_set1_epi64(static_cast<long long>(low)),
+                                    _mm512_setr_epi64(1,7,11,13,17,19,23,29));
+    for(std::size_t k=0;k<byte_count;++k) {
+        __mmask8 lanes=static_cast<__mmask8>(~bytes[k]);
+        unsigned n=static_cast<unsigned>(_mm_popcnt_u32(lanes));
+        __m512i packed=_mm512_maskz_compress_epi64(lanes,values);
+        _mm512_mask_storeu_epi64(out,static_cast<__mmask8>((1u<<n)-1),packed);
+        out+=n;
+        values=_mm512_add_epi64(values,byte_step);
+    }
+    return static_cast<std::size_t>(out-start);
+}
+
+inline __m512i mul_u64_u32(__m512i a,__m512i p) {
+    __m512i lo=_mm512_mul_epu32(a,p);
+    __m512i hi=_mm512_mul_epu32(_mm512_srli_epi64(a,32),p);
+    return _mm512_add_epi64(lo,_mm512_slli_epi64(hi,32));
+}
+
+inline __m512i floor_to_u64(__m512d x,__m512d magic) {
+    __m512d floored=_mm512_roundscale_pd(x,_MM_FROUND_TO_NEG_INF|_MM_FROUND_NO_EXC);
+    return _mm512_sub_epi64(_mm512_castpd_si512(_mm512_add_pd(floored,magic)),_mm512_castpd_si512(magic));
+}
+
+// Same scheme as the AVX2 kernel, with opmasks for the corrections.
+void first_wheel30_hits_avx512(const std::uint32_t*primes,std::size_t count,std::uint64_t start,std::uint64_t*distances,std::uint32_t*wheel_indices) {
+    const __m512d magic=_mm512_set1_pd(4503599627370496.0);
+    const __m512i magic_bits=_mm512_castpd_si512(magic);
+    const __m512d start_d=_mm512_set1_pd(static_cast<double>(start));
+    const __m512i start_v=_mm512_set1_epi64(static_cast<long long>(start));
+    const __m512d inv30=_mm512_set1_pd(1.0/30.0);
+    const __m512i thirty=_mm512_set1_epi64(30);
+    const __m512i one=_mm512_set1_epi64(1);
+    const __m512i zero=_mm512_setzero_si512();
+    const __m512i low_byte=_mm512_set1_epi64(0xFF);
+    std::size_t i=0;
+    for(;i+8<=count;i+=8) {
+        __m256i packed=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(primes+i));
+        __m512i p=_mm512_cvtepu32_epi64(packed);
+        __m512i q=floor_to_u64(_mm512_div_pd(start_d,_mm512_cvtepu32_pd(packed)),magic);
+        __m512i r=_mm512_sub_epi64(start_v,mul_u64_u32(q,p));
+        for(int round=0;round<2;++round) {
+            __mmask8 negative=_mm512_cmplt_epi64_mask(r,zero);
+            q=_mm512_mask_sub_epi64(q,negative,q,one);
+            r=_mm512_mask_add_epi64(r,negative,r,p);
+        }
+        for(int round=0;round<2;++round) {
+            __mmask8 reached=_mm512_cmpge_epi64_mask(r,p);
+            q=_mm512_mask_add_epi64(q,reached,q,one);
+            r=_mm512_mask_sub_epi64(r,reached,r,p);
+        }
+        __m512i m=_mm512_mask_add_epi64(q,_mm512_cmpneq_epi64_mask(r,zero),q,one);
+        m=_mm512_max_epu64(m,p);
+        __m512d md=_mm512_sub_pd(_mm512_castsi512_pd(_mm512_add_epi64(m,magic_bits)),magic);
+        __m512i k=floor_to_u64(_mm512_mul_pd(md,inv30),magic);
+        __m512i residue=_mm512_sub_epi64(m,_mm512_sub_epi64(_mm512_slli_epi64(k,5),_mm512_slli_epi64(k,1)));
+        residue=_mm512_mask_add_epi64(residue,_mm512_cmplt_epi64_mask(residue,zero),residue,thirty);
+        residue=_mm512_mask_sub_epi64(residue,_mm512_cmpge_epi64_mask(residue,thirty),residue,thirty);
+        __m512i advance=_mm512_i64gather_epi64(residue,reinterpret_cast<const long long*>(kWheel30Advance.data()),8);
+        m=_mm512_add_epi64(m,_mm512_and_si512(advance,low_byte));
+        _mm512_storeu_si512(reinterpret_cast<void*>(distances+i),_mm512_sub_epi64(mul_u64_u32(m,p),start_v));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(wheel_indices+i),_mm512_cvtepi64_epi32(_mm512_srli_epi64(advance,8)));
+    }
+    scalar_kernels().first_wheel30_hits(primes+i,count-i,start,distances+i,wheel_indices+i);
+}
+
+// 64x64-bit products from four 32x32 multiplies per lane (AVX-512F has
+// no 64-bit high multiply).
+inline __m512i mul_high_u64x8(__m512i a,__m512i b) {
+    const __m512i low32=_mm512_set1_epi64(0xFFFFFFFF);
+    __m512i a_hi=_mm512_srli_epi64(a,32);
+    __m512i b_hi=_mm512_srli_epi64(b,32);
+    __m512i ll=_mm512_mul_epu32(a,b);
+    __m512i lh=_mm512_mul_epu32(a,b_hi);
+    __m512i hl=_mm512_mul_epu32(a_hi,b);
+    __m512i hh=_mm512_mul_epu32(a_hi,b_hi);
+    __m512i mid=_mm512_add_epi64(_mm512_add_epi64(_mm512_srli_epi64(ll,32),_mm512_and_si512(lh,low32)),_mm512_and_si512(hl,low32));
+    return _mm512_add_epi64(_mm512_add_epi64(hh,_mm512_srli_epi64(lh,32)),_mm512_add_epi64(_mm512_srli_epi64(hl,32),_mm512_srli_epi64(mid,32)));
+}
+
+inline __m512i mul_low_u64x8(__m512i a,__m512i b) {
+    __m512i cross=_mm512_add_epi64(_mm512_mul_epu32(a,_mm512_srli_epi64(b,32)),_mm512_mul_epu32(_mm512_srli_epi64(a,32),b));
+    return _mm512_add_epi64(_mm512_mul_epu32(a,b),_mm512_slli_epi64(cross,32));
+}
+
+inline __m512i montgomery_mul_x8(__m512i a,__m512i b,__m512i n,__m512i n_inv) {
+    __m512i t=mul_high_u64x8(mul_low_u64x8(mul_low_u64x8(a,b),n_inv),n);
+    __m512i high=mul_high_u64x8(a,b);
+    __m512i x=_mm512_sub_epi64(high,t);
+    return _mm512_mask_add_epi64(x,_mm512_cmplt_epu64_mask(high,t),x,n);
+}
+
+// The scalar round on eight moduli at once: every lane walks the bits of
+// the largest exponent, and finished lanes keep their verdict.
+void strong_probable_primes_avx512(const std::uint64_t*n,const std::uint64_t*one,const std::uint64_t*bases,std::size_t count,std::uint8_t*pass) {
+    const __m512i two=_mm512_set1_epi64(2);
+    std::size_t i=0;
+    for(;i+8<=count;i+=8) {
+        __m512i modulus=_mm512_loadu_si512(reinterpret_cast<const void*>(n+i));
+        __m512i unit=_mm512_loadu_si512(reinterpret_cast<const void*>(one+i));
+        __m512i base=bases?_mm512_loadu_si512(reinterpret_cast<const void*>(bases+i)):_mm512_setzero_si512();
+        __m512i n_inv=modulus;
+        for(int k=0;k<5;++k) {
+            n_inv=mul_low_u64x8(n_inv,_mm512_sub_epi64(two,mul_low_u64x8(modulus,n_inv)));
+        }
+        __m512i exponent=_mm512_sub_epi64(modulus,_mm512_set1_epi64(1));
+        __m512i minus_one=_mm512_sub_epi64(modulus,unit);
+        int top=63-std::countl_zero(static_cast<std::uint64_t>(_mm512_reduce_or_epi64(exponent)));
+        __m512i x=unit;
+        __mmask8 ok=0;
+        for(int j=top;j>=1&&ok!=0xFF;--j) {
+            x=montgomery_mul_x8(x,x,modulus,n_inv);
+            __m512i bit=_mm512_set1_epi64(static_cast<long long>(1ULL<<j));
+            __mmask8 set=_mm512_test_epi64_mask(exponent,bit);
+            __m512i stepped;
+            if(bases) {
+                stepped=montgomery_mul_x8(x,base,modulus,n_inv);
+            } else {
+                __m512i gap=_mm512_sub_epi64(modulus,x);
+                stepped=_mm512_mask_sub_epi64(_mm512_add_epi64(x,x),_mm512_cmpge_epu64_mask(x,gap),x,gap);
+            }
+            x=_mm512_mask_mov_epi64(x,set,stepped);
+            // Lanes with j<=ctz(n-1), i.e. no set bit below j.
+            __mmask8 tail=_mm512_testn_epi64_mask(exponent,_mm512_set1_epi64(static_cast<long long>((1ULL<<j)-1)));
+            __mmask8 hit=_mm512_cmpeq_epi64_mask(x,minus_one)|(set&_mm512_cmpeq_epi64_mask(x,unit));
+            ok|=tail&hit;
+        }
+        for(int k=0;k<8;++k) {
+            pass[i+k]=static_cast<std::uint8_t>((ok>>k)&1u);
+        }
+    }
+    scalar_kernels().strong_probable_primes(n+i,one+i,bases?bases+i:nullptr,count-i,pass+i);
+}
+
+}
+
+const KernelTable*avx512_kernels() {
+    static const KernelTable table{
+        KernelIsa::Avx512,
+        count_zero_bits_avx512,
+        shift_copy_avx512,
+        or_small_streams_avx512,
+        extract_odd_bits_avx512,
+        extract_wheel30_bytes_avx512,
+        first_wheel30_hits_avx512,
+        strong_probable_primes_avx512,
+    };
+    return&table;
+}
+
+}
+
+#else
+
+namespace calcprime {
+
+const KernelTable*avx512_kernels() {
+    return nullptr;
+}
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "kernels.h"
+
+#include "divider.h"
+#include "popcnt.h"
+#include "wheel.h"
+
+#include <bit>
+
+namespace calcprime {
+namespace {
+
+std::uint64_t count_zero_bits_scalar(const std::uint64_t*bits,std::size_t bit_count) {
+    std::size_t full_words=bit_count/64;
+    std::size_t rem_bits=bit_count%64;
+    std::uint64_t total=0;
+    for(std::size_t i=0;i<full_words;++i) {
+        total+=64-popcount_u64(bits[i]);
+    }
+    if(rem_bits) {
+        std::uint64_t mask=(1ULL<<rem_bits)-1;
+        total+=rem_bits-popcount_u64(bits[full_words]&mask);
+    }
+    return total;
+}
+
+void shift_copy_scalar(std::uint64_t*dst,const std::uint64_t*src,std::size_t word_count,unsigned shift) {
+    for(std::size_t i=0;i<word_count;++i) {
+        dst[i]=(src[i]>>shift)|(src[i+1]<<(64-shift));
+    }
+}
+
+void or_small_streams_scalar(std::uint64_t*words,std::size_t word_count,const std::uint64_t*const*streams,const std::uint32_t*periods,std::uint32_t*cursors) {
+    const std::uint64_t*s0=streams[0];
+    const std::uint64_t*s1=streams[1];
+    const std::uint64_t*s2=streams[2];
+    const std::uint64_t*s3=streams[3];
+    std::uint32_t c[kSmallStreamGroup]={cursors[0],cursors[1],cursors[2],cursors[3]};
+    auto advance=[periods,&c](std::uint32_t step) {
+        for(std::size_t k=0;k<kSmallStreamGroup;++k) {
+            c[k]+=step;
+            c[k]-=c[k]>=periods[k]?periods[k]:0;
+        }
+    };
+    std::size_t w=0;
+    for(;w+4<=word_count;w+=4) {
+        for(std::size_t k=0;k<4;++k) {
+            words[w+k]|=s0[c[0]+k]|s1[c[1]+k]|s2[c[2]+k]|s3[c[3]+k];
+        }
+        advance(4);
+    }
+    for(;w<word_count;++w) {
+        words[w]|=s0[c[0]]|s1[c[1]]|s2[c[2]]|s3[c[3]];
+        advance(1);
+    }
+    for(std::size_t k=0;k<kSmallStreamGroup;++k) {
+        cursors[k]=c[k];
+    }
+}
+
+std::size_t extract_odd_bits_scalar(const std::uint64_t*bits,std::size_t bit_count,std::uint64_t low,std::uint64_t*out) {
+    std::size_t produced=0;
+    std::size_t word_count=(bit_count+63)/64;
+    for(std::size_t w=0;w<word_count;++w) {
+        std::uint64_t live=~bits[w];
+        if(w+1==word_count&&bit_count%64!=0) {
+            live&=(1ULL<<(bit_count%64))-1;
+        }
+        std::uint64_t base=low+128ULL*w;
+        while(live) {
+            out[produced++]=base+2ULL*static_cast<std::uint64_t>(std::countr_zero(live));
+            live&=live-1;
+        }
+    }
+    return produced;
+}
+
+std::size_t extract_wheel30_bytes_scalar(const std::uint8_t*bytes,std::size_t byte_count,std::uint64_t low,std::uint64_t*out) {
+    std::size_t produced=0;
+    for(std::size_t k=0;k<byte_count;++k) {
+        unsigned live=static_cast<std::uint8_t>(~bytes[k]);
+        std::uint64_t base=low+30ULL*k;
+        while(live) {
+            out[produced++]=base+kWheel30Residues[std::countr_zero(live)];
+            live&=live-1;
+        }
+    }
+    return produced;
+}
+
+void first_wheel30_hits_scalar(const std::uint32_t*primes,std::size_t count,std::uint64_t start,std::uint64_t*distances,std::uint32_t*wheel_indices) {
+    for(std::size_t i=0;i<count;++i) {
+        std::uint64_t p=primes[i];
+        std::uint64_t m=start/p+(start%p!=0?1:0);
+        if(m<p) {
+            m=p;
+        }
+        std::uint64_t advance=kWheel30Advance[m%30];
+        m+=advance&0xFF;
+        // p*m may wrap, but its distance from start always fits.
+        distances[i]=p*m-start;
+        wheel_indices[i]=static_cast<std::uint32_t>(advance>>8);
+    }
+}
+
+std::uint64_t montgomery_mul(std::uint64_t a,std::uint64_t b,std::uint64_t n,std::uint64_t n_inv) {
+    std::uint64_t t=mul_high_u64(a*b*n_inv,n);
+    std::uint64_t high=mul_high_u64(a,b);
+    return high>=t?high-t:high-t+n;
+}
+
+// Walks the bits of n-1 from the top. Past bit r=ctz(n-1) only squarings
+// remain, so x=a^d at bit r and the later values are a^(d*2^i).
+void strong_probable_primes_scalar(const std::uint64_t*n,const std::uint64_t*one,const std::uint64_t*bases,std::size_t count,std::uint8_t*pass) {
+    for(std::size_t i=0;i<count;++i) {
+        std::uint64_t modulus=n[i];
+        std::uint64_t n_inv=modulus;
+        for(int k=0;k<5;++k) {
+            n_inv*=2-modulus*n_inv;
+        }
+        std::uint64_t exponent=modulus-1;
+        std::uint64_t unit=one[i];
+        std::uint64_t minus_one=modulus-unit;
+        unsigned r=static_cast<unsigned>(std::countr_zero(exponent));
+        int top=63-std::countl_zero(exponent);
+        std::uint64_t x=unit;
+        bool ok=false;
+        for(int j=top;j>=1;--j) {
+            x=montgomery_mul(x,x,modulus,n_inv);
+            if(bases) {
+                if((exponent>>j)&1ULL) {
+                    x=montgomery_mul(x,bases[i],modulus,n_inv);
+                }
+            } else {
+                // Select instead of branching: the exponent bits are random.
+                std::uint64_t doubled=x>=modulus-x?x-(modulus-x):x+x;
+                std::uint64_t mask=0-((exponent>>j)&1ULL);
+                x=(doubled&mask)|(x&~mask);
+            }
+            if(static_cast<unsigned>(j)<=r&&(x==minus_one||(static_cast<unsigned>(j)==r&&x==unit))) {
+                ok=true;
+                break;
+            }
+        }
+        pass[i]=ok?1:0;
+    }
+}
+
+}
+
+const KernelTable&scalar_kernels() {
+    static const KernelTable table{
+        KernelIsa::Scalar,
+        count_zero_bits_scalar,
+        shift_copy_scalar,
+        or_small_streams_scalar,
+        extract_odd_bits_scalar,
+        extract_wheel30_bytes_scalar,
+        first_wheel30_hits_scalar,
+        strong_probable_primes_scalar,
+    };
+    return table;
+}
+
+}
@@ -1,20 +1,27 @@
 #include "base_sieve.h"
 #include "cpu_info.h"
+#include "deleglise_rivat.h"
+#include "kernels.h"
 #include "marker.h"
+#include "nth_prime.h"
 #include "popcnt.h"
+#include "prime_cache.h"
 #include "prime_count.h"
+#include "prime_search.h"
 #include "segmenter.h"
 #include "wheel.h"
 #include "writer.h"
 
 #include <algorithm>
 #include <atomic>
+#include <charconv>
 #include <chrono>
 #include <cinttypes>
 #include <cstddef>
 #include <cstdint>
 #include <cmath>
 #include <condition_variable>
+#include <cstdio>
 #include <exception>
 #include <iomanip>
 #include <iostream>
@@ -25,6 +32,7 @@
 #include <thread>
 #include <vector>
 #include <limits>
+#include <memory>
 
 namespace calcprime {
 
@@ -37,15 +45,21 @@ struct Options {
     std::optional<std::uint64_t>nth;
     unsigned threads=0;
     WheelType wheel=WheelType::Mod30;
+    SieveLayout layout=SieveLayout::OddBits;
+    HybridMode hybrid=HybridMode::Auto;
     std::size_t segment_bytes=0;
     std::size_t tile_bytes=0;
     std::string output_path;
+    std::string prime_cache_path;
     PrimeOutputFormat output_format=PrimeOutputFormat::Text;
     bool show_time=false;
     bool show_stats=false;
-    bool use_ml=false;
+    CountMethod count_method=CountMethod::Auto;
     bool help=false;
     std::optional<std::uint64_t>test_value;
+    std::string test_file;
+    std::optional<std::uint64_t>next_after;
+    std::optional<std::uint64_t>prev_before;
 };
 
 std::uint64_t parse_u64(const std::string&value) {
@@ -150,6 +164,7 @@ std::size_t parse_size(const std::string&value) {
 
 Options parse_options(int argc,char**argv) {
     Options opts;
+    opts.prime_cache_path=prime_cache_path_from_env();
     for(int i=1;i<argc;++i) {
         std::string arg=argv[i];
         static const std::string out_format_prefix="--out-format=";
@@ -209,6 +224,18 @@ Options parse_options(int argc,char**argv) {
             } else {
                 throw std::invalid_argument("unsupported wheel: "+w);
             }
+        } else if(arg=="--layout") {
+            if(i+1>=argc) {
+                throw std::invalid_argument("--layout requires a value");
+            }
+            std::string l=argv[++i];
+            if(l=="odd") {
+                opts.layout=SieveLayout::OddBits;
+            } else if(l=="mod30") {
+                opts.layout=SieveLayout::Mod30Bytes;
+            } else {
+                throw std::invalid_argument("unsupported layout: "+l);
+            }
         } else if(arg=="--segment") {
             if(i+1>=argc) {
                 throw std::invalid_argument("--segment requires a value");
@@ -238,17 +265,65 @@ Options parse_options(int argc,char**argv) {
             } else {
                 throw std::invalid_argument("unsupported out-format: "+fmt);
             }
+        } else if(arg=="--hybrid") {
+            if(i+1>=argc) {
+                throw std::invalid_argument("--hybrid requires a value");
+            }
+            std::string mode=argv[++i];
+            if(mode=="auto") {
+                opts.hybrid=HybridMode::Auto;
+            } else if(mode=="on") {
+                opts.hybrid=HybridMode::On;
+            } else if(mode=="off") {
+                opts.hybrid=HybridMode::Off;
+            } else {
+                throw std::invalid_argument("unsupported hybrid mode: "+mode);
+            }
+        } else if(arg=="--prime-cache") {
+            if(i+1>=argc) {
+                throw std::invalid_argument("--prime-cache requires a path");
+            }
+            opts.prime_cache_path=argv[++i];
         } else if(arg=="--time") {
             opts.show_time=true;
         } else if(arg=="--stats") {
             opts.show_stats=true;
         } else if(arg=="--ml") {
-            opts.use_ml=true;
+            opts.count_method=CountMethod::Analytic;
+        } else if(arg=="--method") {
+            if(i+1>=argc) {
+                throw std::invalid_argument("--method requires a value");
+            }
+            std::string method=argv[++i];
+            if(method=="auto") {
+                opts.count_method=CountMethod::Auto;
+            } else if(method=="sieve") {
+                opts.count_method=CountMethod::Sieve;
+            } else if(method=="analytic") {
+                opts.count_method=CountMethod::Analytic;
+            } else {
+                throw std::invalid_argument("unsupported count method: "+method);
+            }
         } else if(arg=="--test") {
             if(i+1>=argc) {
                 throw std::invalid_argument("--test requires a value");
             }
             opts.test_value=parse_u64(argv[++i]);
+        } else if(arg=="--next") {
+            if(i+1>=argc) {
+                throw std::invalid_argument("--next requires a value");
+            }
+            opts.next_after=parse_u64(argv[++i]);
+        } else if(arg=="--prev") {
+            if(i+1>=argc) {
+                throw std::invalid_argument("--prev requires a value");
+            }
+            opts.prev_before=parse_u64(argv[++i]);
+        } else if(arg=="--test-file") {
+            if(i+1>=argc) {
+                throw std::invalid_argument("--test-file requires a path");
+            }
+            opts.test_file=argv[++i];
         } else {
             throw std::invalid_argument("unknown option: "+arg);
         }
@@ -263,14 +338,124 @@ void print_usage() {
               <<"  --nth K             Find the K-th prime in the interval\n"
               <<"  --threads N         Override thread count\n"
               <<"  --wheel 30|210|1155 Select wheel factorisation (default 30)\n"
+              <<"  --layout odd|mod30  Segment bitset layout: one bit per odd number (default)\n"
+              <<"                      or 8 residues coprime to 30 per byte (requires --wheel 30)\n"
               <<"  --segment BYTES     Override segment size\n"
               <<"  --tile BYTES        Override tile size\n"
               <<"  --out PATH          Write primes to file\n"
               <<"  --out-format FMT    Output format: text (default), binary, zstd\n"
+              <<"  --hybrid MODE       auto (default): sieve tiny windows only with small primes and\n"
+              <<"                      confirm candidates with Miller-Rabin when cheaper; on|off\n"
+              <<"  --prime-cache PATH  Map sieving primes from a cache file, extending it as needed\n"
+              <<"                      (default: $CALCPRIME_PRIME_CACHE)\n"
               <<"  --time              Print elapsed time\n"
               <<"  --stats             Print configuration statistics\n"
-              <<"  --ml                Use Meissel-Lehmer counting for --count\n"
-              <<"  --test N           Run a Miller-Rabin primality check for N\n";
+              <<"  --method MODE       Counting method: auto (default) picks the sieve or two\n"
+              <<"                      Deleglise-Rivat evaluations by cost; sieve|analytic\n"
+              <<"  --ml                Same as --method analytic\n"
+              <<"  --test N           Run a Miller-Rabin primality check for N\n"
+              <<"  --next N            Print the smallest prime above N\n"
+              <<"  --prev N            Print the largest prime below N\n"
+              <<"  --test-file PATH    Test every decimal number in PATH (- for stdin) and print\n"
+              <<"                      \"N prime\" or \"N composite\" per number\n";
+}
+
+// Numbers per is_prime_batch call; the output of one batch is written
+// before the next is read.
+constexpr std::size_t kTestBatch=1<<20;
+
+int run_test_file(const Options&opts) {
+    std::FILE*input=opts.test_file=="-"?stdin:std::fopen(opts.test_file.c_str(),"rb");
+    if(!input) {
+        throw std::runtime_error("cannot open "+opts.test_file);
+    }
+    std::unique_ptr<std::FILE,int(*)(std::FILE*)>owner(input==stdin?nullptr:input,std::fclose);
+    unsigned threads=opts.threads?opts.threads:effective_thread_count(detect_cpu_info());
+
+    auto start_time=std::chrono::steady_clock::now();
+    std::vector<std::uint64_t>values;
+    values.reserve(kTestBatch);
+    std::vector<std::uint8_t>verdicts;
+    std::string output;
+    std::uint64_t tested=0;
+    std::uint64_t primes=0;
+    auto flush=[&]() {
+        verdicts.resize(values.size());
+        is_prime_batch(values.data(),values.size(),verdicts.data(),threads);
+        output.clear();
+        for(std::size_t i=0;i<values.size();++i) {
+            char digits[24];
+            auto result=std::to_chars(digits,digits+sizeof(digits),values[i]);
+            output.append(digits,result.ptr);
+            output.append(verdicts[i]?" prime\n":" composite\n");
+            primes+=verdicts[i];
+        }
+        tested+=values.size();
+        values.clear();
+        if(std::fwrite(output.data(),1,output.size(),stdout)!=output.size()) {
+            throw std::runtime_error("failed to write results");
+        }
+    };
+
+    std::vector<char>buffer(1<<16);
+    std::uint64_t value=0;
+    bool in_number=false;
+    bool overflow=false;
+    for(;;) {
+        std::size_t got=std::fread(buffer.data(),1,buffer.size(),input);
+        for(std::size_t i=0;i<got;++i) {
+            char c=buffer[i];
+            if(c>='0'&&c<='9') {
+                unsigned digit=static_cast<unsigned>(c-'0');
+                overflow|=value>(std::numeric_limits<std::uint64_t>::max()-digit)/10;
+                value=value*10+digit;
+                in_number=true;
+            } else if(c==' '||c=='\n'||c=='\r'||c=='\t'||c==',') {
+                if(in_number) {
+                    if(overflow) {
+                        throw std::invalid_argument("integer too large in "+opts.test_file);
+                    }
+                    values.push_back(value);
+                    if(values.size()==kTestBatch) {
+                        flush();
+                    }
+                }
+                value=0;
+                in_number=false;
+            } else {
+                throw std::invalid_argument(std::string("invalid character '")+c+"' in "+opts.test_file);
+            }
+        }
+        if(got<buffer.size()) {
+            break;
+        }
+    }
+    if(std::ferror(input)) {
+        throw std::runtime_error("failed to read "+opts.test_file);
+    }
+    if(in_number) {
+        if(overflow) {
+            throw std::invalid_argument("integer too large in "+opts.test_file);
+        }
+        values.push_back(value);
+    }
+    flush();
+    std::fflush(stdout);
+    auto end_time=std::chrono::steady_clock::now();
+
+    double seconds=std::chrono::duration<double>(end_time-start_time).count();
+    if(opts.show_stats) {
+        std::cout<<"Tested: "<<tested<<"\n";
+        std::cout<<"Primes: "<<primes<<"\n";
+        std::cout<<"Threads: "<<threads<<"\n";
+        std::cout<<"Kernels: "<<kernel_isa_name(active_kernels().isa)<<"\n";
+        std::cout<<"Throughput: "<<static_cast<std::uint64_t>(seconds>0?tested/seconds:0)<<" numbers/s\n";
+    }
+    if(opts.show_time) {
+        auto elapsed=std::chrono::duration_cast<std::chrono::microseconds>(end_time-start_time).count();
+        std::cout<<"Elapsed: "<<elapsed<<" us\n";
+    }
+    return 0;
 }
 
 struct SegmentResult {
@@ -286,6 +471,26 @@ int run_cli(int argc,char**argv) {
             print_usage();
             return 0;
         }
+        if(!opts.test_file.empty()) {
+            return run_test_file(opts);
+        }
+        if(opts.next_after.has_value()||opts.prev_before.has_value()) {
+            if(opts.prev_before.has_value()) {
+                std::uint64_t prime=prev_prime(opts.prev_before.value());
+                if(prime==0) {
+                    throw std::invalid_argument("no prime below "+std::to_string(opts.prev_before.value()));
+                }
+                std::cout<<prime<<"\n";
+            }
+            if(opts.next_after.has_value()) {
+                std::uint64_t prime=next_prime(opts.next_after.value());
+                if(prime==0) {
+                    throw std::invalid_argument("no 64-bit prime above "+std::to_string(opts.next_after.value()));
+                }
+                std::cout<<prime<<"\n";
+            }
+            return 0;
+        }
         if(opts.test_value.has_value()&&!opts.has_to) {
             bool is_prime=miller_rabin_is_prime(opts.test_value.value());
             std::cout<<(is_prime ?"prime" :"composite")<<"\n";
@@ -302,10 +507,15 @@ int run_cli(int argc,char**argv) {
         if(opts.to<=opts.from||opts.to<2) {
             throw std::invalid_argument("invalid range");
         }
+        if(opts.layout==SieveLayout::Mod30Bytes&&opts.wheel!=WheelType::Mod30) {
+            throw std::invalid_argument("the mod30 layout requires --wheel 30");
+        }
 
         CpuInfo info=detect_cpu_info();
         unsigned threads=opts.threads?opts.threads:effective_thread_count(info);
-        if(opts.nth.has_value()) {
+        // --nth while printing walks the primes in order on one thread.
+        bool parallel_nth=opts.nth.has_value()&&!opts.print_primes&&!opts.count_only;
+        if(opts.nth.has_value()&&!parallel_nth) {
             threads=1;
         }
         if(threads==0) {
@@ -331,30 +541,62 @@ int run_cli(int argc,char**argv) {
         std::uint64_t length=(range.end>range.begin)?(range.end-range.begin):0;
 
         SegmentConfig config=
-            choose_segment_config(info,threads,opts.segment_bytes,opts.tile_bytes,length);
+            choose_segment_config(info,threads,opts.segment_bytes,opts.tile_bytes,length,opts.layout);
         const Wheel&wheel=get_wheel(opts.wheel);
-        std::uint32_t small_limit=29u;
-        switch(opts.wheel) {
-        case WheelType::Mod30:
-            small_limit=29u;
-            break;
-        case WheelType::Mod210:
-            small_limit=47u;
-            break;
-        case WheelType::Mod1155:
-            small_limit=47u;
-            break;
+        // Contiguous blocks keep every thread's sieving state local; printing
+        // needs segments in order, so it stays on the dynamic queue.
+        SegmentSchedule schedule=(threads>1&&!opts.print_primes)?SegmentSchedule::Contiguous:SegmentSchedule::Dynamic;
+        SegmentWorkQueue queue(range,config,schedule,threads);
+        std::size_t num_segments=queue.segment_count();
+
+        if(parallel_nth) {
+            auto start_time=std::chrono::steady_clock::now();
+            NthPrime nth=find_nth_prime(opts.from,opts.to,opts.nth.value(),wheel,config,opts.count_method,opts.hybrid,opts.prime_cache_path,threads);
+            auto end_time=std::chrono::steady_clock::now();
+            if(nth.prime==0) {
+                std::cerr<<"nth prime not found within range\n";
+                return 1;
+            }
+            std::cout<<nth.prime<<"\n";
+
+            if(opts.show_stats) {
+                std::cout<<"Threads: "<<threads<<"\n";
+                std::cout<<"Segment bytes: "<<config.segment_bytes<<"\n";
+                std::cout<<"Tile bytes: "<<config.tile_bytes<<"\n";
+                std::cout<<"Prime cache: "<<prime_cache_outcome_name(nth.cache_outcome)<<"\n";
+                if(nth.count_method==CountMethod::Analytic) {
+                    std::cout<<"Strategy: nth (analytic count to "<<nth.counted_to<<", then sieve)\n";
+                } else if(nth.hybrid_bound) {
+                    std::cout<<"Strategy: nth (hybrid, sieve to "<<nth.hybrid_bound<<", Miller-Rabin)\n";
+                } else {
+                    std::cout<<"Strategy: nth (sieve)\n";
+                }
+                std::cout<<"L1d: "<<info.l1_data_bytes<<"  L2: "<<info.l2_bytes<<"\n";
+            }
+
+            if(opts.show_time) {
+                auto elapsed=std::chrono::duration_cast<std::chrono::microseconds>(end_time-start_time).count();
+                std::cout<<"Elapsed: "<<elapsed<<" us\n";
+            }
+
+            return 0;
         }
-        std::size_t num_segments=length?static_cast<std::size_t>((length+config.segment_span-1)/config.segment_span):0;
 
+        bool is_count_mode=opts.count_only||(!opts.print_primes&&!opts.nth.has_value());
         std::uint64_t sqrt_limit=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(opts.to)))+1;
-        auto base_primes=simple_sieve(sqrt_limit);
+        // Printing and --nth need the sieve.
+        CountMethod count_method=is_count_mode?choose_count_method(opts.count_method,opts.from,opts.to,config):CountMethod::Sieve;
+        std::uint64_t hybrid_bound=0;
+        if(count_method==CountMethod::Sieve) {
+            hybrid_bound=hybrid_sieve_bound(opts.hybrid,config,range.begin,range.end,!opts.prime_cache_path.empty());
+        }
+        PrimeCacheOutcome cache_outcome=PrimeCacheOutcome::Disabled;
+        BasePrimes base_primes=sieving_primes(opts.prime_cache_path,hybrid_bound?hybrid_bound:sqrt_limit,threads,&cache_outcome);
 
-        bool is_count_mode=opts.count_only||(!opts.print_primes&&!opts.nth.has_value());
         auto start_time=std::chrono::steady_clock::now();
 
-        if(opts.use_ml&&is_count_mode) {
-            std::uint64_t result=meissel_count(opts.from,opts.to,base_primes,threads);
+        if(count_method==CountMethod::Analytic) {
+            std::uint64_t result=deleglise_rivat_count(opts.from,opts.to,base_primes,threads);
             auto end_time=std::chrono::steady_clock::now();
 
             std::cout<<result<<"\n";
@@ -364,6 +606,8 @@ int run_cli(int argc,char**argv) {
                 std::cout<<"Threads: "<<ml_threads<<"\n";
                 std::cout<<"Segment bytes: 0\n";
                 std::cout<<"Tile bytes: 0\n";
+                std::cout<<"Prime cache: "<<prime_cache_outcome_name(cache_outcome)<<"\n";
+                std::cout<<"Strategy: analytic (Deleglise-Rivat)\n";
                 std::cout<<"L1d: "<<info.l1_data_bytes<<"  L2: "<<info.l2_bytes<<"\n";
             }
 
@@ -375,8 +619,7 @@ int run_cli(int argc,char**argv) {
             return 0;
         }
 
-        PrimeMarker marker(wheel,config,range.begin,range.end,base_primes,small_limit);
-        SegmentWorkQueue queue(range,config);
+        PrimeMarker marker(wheel,config,range.begin,range.end,base_primes,wheel.small_prime_limit,threads);
 
         std::vector<SegmentResult>segment_results(num_segments);
         std::mutex segment_ready_mutex;
@@ -394,19 +637,7 @@ int run_cli(int argc,char**argv) {
         if(include_two) {
             prefix_primes.push_back(2);
         }
-        std::vector<std::uint64_t>wheel_primes;
-        switch(opts.wheel) {
-        case WheelType::Mod30:
-            wheel_primes={3,5};
-            break;
-        case WheelType::Mod210:
-            wheel_primes={3,5,7};
-            break;
-        case WheelType::Mod1155:
-            wheel_primes={3,5,7,11};
-            break;
-        }
-        for(std::uint64_t p : wheel_primes) {
+        for(std::uint64_t p : wheel.presieve_primes) {
             if(p>=opts.from&&p<opts.to) {
                 prefix_primes.push_back(p);
             }
@@ -425,37 +656,27 @@ int run_cli(int argc,char**argv) {
 
         for(unsigned t=0;t<threads;++t) {
             workers.emplace_back([&,t]() {
-                auto state=marker.make_thread_state(t,threads);
+                auto state=marker.make_thread_state(queue.first_segment(t));
                 std::vector<std::uint64_t>bitset;
+                SegmentCounts counts;
                 std::uint64_t cumulative=prefix_count;
                 while(!stop.load(std::memory_order_relaxed)) {
                     std::uint64_t segment_id=0;
                     std::uint64_t seg_low=0;
                     std::uint64_t seg_high=0;
-                    if(!queue.next(segment_id,seg_low,seg_high)) {
+                    if(!queue.next(t,segment_id,seg_low,seg_high)) {
                         break;
                     }
-                    marker.sieve_segment(state,segment_id,seg_low,seg_high,bitset);
-                    std::size_t bit_count=static_cast<std::size_t>((seg_high-seg_low)>>1);
-                    std::uint64_t local_count=count_zero_bits(bitset.data(),bit_count);
+                    marker.sieve_segment(state,segment_id,seg_low,seg_high,bitset,&counts);
+                    std::uint64_t local_count=counts.total;
                     if(segment_id<segment_results.size()) {
                         segment_results[segment_id].count=local_count;
                     }
                     bool need_primes=opts.print_primes||(opts.nth.has_value()&&threads==1);
                     if(need_primes&&segment_id<segment_results.size()) {
                         std::vector<std::uint64_t>primes;
-                        primes.reserve(static_cast<std::size_t>(local_count));
-                        std::uint64_t value=seg_low;
-                        std::size_t produced=0;
-                        for(std::size_t word=0;word<bitset.size()&&produced<bit_count;++word) {
-                            std::uint64_t composite=bitset[word];
-                            for(std::size_t bit=0;bit<64&&produced<bit_count;++bit,++produced,value+=2) {
-                                if(composite&(1ULL<<bit)) {
-                                    continue;
-                                }
-                                primes.push_back(value);
-                            }
-                        }
+                        primes.resize(static_cast<std::size_t>(local_count));
+                        marker.extract_primes(bitset,seg_low,seg_high,primes.data());
                         segment_results[segment_id].primes=std::move(primes);
                         {
                             std::lock_guard<std::mutex>lock(segment_ready_mutex);
@@ -482,18 +703,8 @@ int run_cli(int argc,char**argv) {
                             if(nth_target>base&&nth_target<=new_total) {
 
                                 std::vector<std::uint64_t>primes;
-                                primes.reserve(static_cast<std::size_t>(local_count));
-                                std::uint64_t value=seg_low;
-                                std::size_t produced=0;
-                                for(std::size_t word=0;word<bitset.size()&&produced<bit_count;++word) {
-                                    std::uint64_t composite=bitset[word];
-                                    for(std::size_t bit=0;bit<64&&produced<bit_count;++bit,++produced,value+=2) {
-                                        if(composite&(1ULL<<bit)) {
-                                            continue;
-                                        }
-                                        primes.push_back(value);
-                                    }
-                                }
+                                primes.resize(static_cast<std::size_t>(local_count));
+                                marker.extract_primes(bitset,seg_low,seg_high,primes.data());
                                 std::size_t index=static_cast<std::size_t>(nth_target-base-1);
                                 if(index<primes.size()) {
                                     nth_value=primes[index];
@@ -598,6 +809,14 @@ int run_cli(int argc,char**argv) {
             std::cout<<"Threads: "<<threads<<"\n";
             std::cout<<"Segment bytes: "<<config.segment_bytes<<"\n";
             std::cout<<"Tile bytes: "<<config.tile_bytes<<"\n";
+            std::cout<<"Layout: "<<(config.layout==SieveLayout::Mod30Bytes?"mod30":"odd")<<"\n";
+            std::cout<<"Kernels: "<<kernel_isa_name(active_kernels().isa)<<"\n";
+            std::cout<<"Prime cache: "<<prime_cache_outcome_name(cache_outcome)<<"\n";
+            if(hybrid_bound) {
+                std::cout<<"Strategy: hybrid (sieve to "<<hybrid_bound<<", Miller-Rabin)\n";
+            } else {
+                std::cout<<"Strategy: sieve\n";
+            }
             std::cout<<"L1d: "<<info.l1_data_bytes<<"  L2: "<<info.l2_bytes<<"\n";
         }
 
@@ -1,14 +1,171 @@
 #include "marker.h"
 
+#include "kernels.h"
+#include "prime_count.h"
+
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <thread>
 
 namespace calcprime {
 namespace {
 
+struct PackedStep {
+    std::uint8_t mask;
+    std::uint8_t extra;
+};
+
+// kPackedSteps[r][i]: for a prime p=30q+kWheel30Residues[r] and a multiplier
+// m with m%30==kWheel30Residues[i], the bit of p*m within its byte and the
+// carry that, added to q*kWheel30Gaps[i], gives the byte distance to the
+// next multiple p*(m+gap).
+constexpr std::array<std::array<PackedStep,8>,8>kPackedSteps=[] {
+    std::array<std::array<PackedStep,8>,8>table{};
+    for(std::size_t r=0;r<8;++r) {
+        std::uint32_t residue=kWheel30Residues[r];
+        for(std::size_t i=0;i<8;++i) {
+            std::uint32_t w=kWheel30Residues[i];
+            std::uint32_t g=kWheel30Gaps[i];
+            table[r][i].mask=static_cast<std::uint8_t>(1u<<kWheel30BitIndex[(residue*w)%30]);
+            table[r][i].extra=static_cast<std::uint8_t>((residue*(w+g))/30-(residue*w)/30);
+        }
+    }
+    return table;
+}();
+
+// Multipliers m coprime to Modulus (30 or 210), in increasing order.
+// Consecutive multiples p*m of a medium prime are half_gaps[i]*p bits apart
+// in the odd-only bitset; offsets[i] is the bit distance (in units of p)
+// from the first multiplier of a turn to the i-th one.
+template<std::uint32_t Modulus,std::size_t Count>
+struct HitWheel {
+    std::array<std::uint8_t,Count>half_gaps;
+    std::array<std::uint16_t,Count>offsets;
+    std::array<std::uint8_t,Modulus>index;
+};
+
+template<std::uint32_t Modulus,std::size_t Count>
+constexpr HitWheel<Modulus,Count>make_hit_wheel() {
+    HitWheel<Modulus,Count>wheel{};
+    std::array<std::uint32_t,Count>residues{};
+    std::size_t count=0;
+    for(std::uint32_t r=0;r<Modulus;++r) {
+        wheel.index[r]=0xFF;
+        if(std::gcd(r,Modulus)==1) {
+            wheel.index[r]=static_cast<std::uint8_t>(count);
+            residues[count++]=r;
+        }
+    }
+    std::uint32_t offset=0;
+    for(std::size_t i=0;i<Count;++i) {
+        std::uint32_t next=i+1<Count?residues[i+1]:residues[0]+Modulus;
+        wheel.half_gaps[i]=static_cast<std::uint8_t>((next-residues[i])/2);
+        wheel.offsets[i]=static_cast<std::uint16_t>(offset);
+        offset+=wheel.half_gaps[i];
+    }
+    return wheel;
+}
+
+constexpr auto kHitWheel30=make_hit_wheel<30,8>();
+constexpr auto kHitWheel210=make_hit_wheel<210,48>();
+
+// Smallest multiple p*m with m>=min_multiplier, m>=p and m coprime to the
+// wheel. Callers pass ceil(start/p), computed by division or a FastDivider.
+template<std::uint32_t Modulus,std::size_t Count>
+std::uint64_t first_wheel_hit(const HitWheel<Modulus,Count>&wheel,std::uint64_t p,std::uint64_t min_multiplier,std::uint32_t&wheel_index) {
+    std::uint64_t m=min_multiplier;
+    if(m<p) {
+        m=p;
+    }
+    std::uint32_t residue=static_cast<std::uint32_t>(m%Modulus);
+    while(wheel.index[residue]==0xFF) {
+        ++m;
+        residue=residue+1==Modulus?0:residue+1;
+    }
+    wheel_index=wheel.index[residue];
+    if(mul_high_u64(p,m)!=0) {
+        return std::numeric_limits<std::uint64_t>::max();
+    }
+    return p*m;
+}
+
+std::uint64_t ceil_multiplier(const FastDivider&divider,std::uint64_t start) {
+    std::uint64_t q=divider.divide(start);
+    return q+(start-q*divider.divisor!=0?1:0);
+}
+
+// Crosses off p*m for the wheel multipliers m within [bit,limit) of a tile.
+// Steps one gap at a time up to the start of a wheel turn, then marks whole
+// turns with a fixed, fully unrolled sequence of offsets.
+template<std::uint32_t Modulus,std::size_t Count>
+void cross_off_wheel(const HitWheel<Modulus,Count>&wheel,std::uint64_t*words,std::size_t limit,std::size_t prime,std::size_t&bit,std::uint32_t&wheel_index) {
+    std::size_t b=bit;
+    std::uint32_t w=wheel_index;
+    while(w!=0&&b<limit) {
+        words[b>>6]|=1ULL<<(b&63);
+        b+=prime*wheel.half_gaps[w];
+        w=w+1==Count?0:w+1;
+    }
+    if(w==0) {
+        std::size_t last=prime*wheel.offsets[Count-1];
+        std::size_t turn=prime*(Modulus/2);
+        for(;b+last<limit;b+=turn) {
+            for(std::size_t i=0;i<Count;++i) {
+                std::size_t hit=b+prime*wheel.offsets[i];
+                words[hit>>6]|=1ULL<<(hit&63);
+            }
+        }
+        while(b<limit) {
+            words[b>>6]|=1ULL<<(b&63);
+            b+=prime*wheel.half_gaps[w];
+            w=w+1==Count?0:w+1;
+        }
+    }
+    bit=b;
+    wheel_index=w;
+}
+
+// Short groups of small-prime streams are padded with an all-zero stream.
+// Its period of 8 lets the widest kernel step a whole vector at a time.
+alignas(64) constexpr std::array<std::uint64_t,16>kZeroStream{};
+constexpr std::uint32_t kZeroStreamPeriod=8;
+
 std::size_t words_for_bits(std::size_t bits) {
     return (bits+63)/64;
 }
 
+// Large primes are positioned this many at a time.
+constexpr std::size_t kFirstHitBatch=256;
+// Below this many large primes per thread the constructor filters serially.
+constexpr std::size_t kMinFilterPrimesPerThread=1u<<16;
+
+// Batched first hits for ascending primes; the few primes too small for the
+// vector kernels' double-precision quotient go to the scalar kernel.
+void first_wheel30_hits(const std::uint32_t*primes,std::size_t count,std::uint64_t start,std::uint64_t*distances,std::uint32_t*wheel_indices) {
+    std::uint64_t min_prime=start/kFirstHitQuotientLimit;
+    std::size_t exact=static_cast<std::size_t>(std::partition_point(primes,primes+count,[min_prime](std::uint32_t prime) {
+        return prime<=min_prime;
+    })-primes);
+    scalar_kernels().first_wheel30_hits(primes,exact,start,distances,wheel_indices);
+    active_kernels().first_wheel30_hits(primes+exact,count-exact,start,distances+exact,wheel_indices+exact);
+}
+
+// Cost model of hybrid_sieve_bound, in nanoseconds on one core: reading
+// and filtering one large sieving prime, generating one when there is no
+// cache, and a Miller-Rabin test of one candidate near 2^64 (about half of
+// the candidates left by the medium tier there are prime).
+constexpr long double kScanNsPerPrime=4.0L;
+constexpr long double kGenerateNsPerPrime=11.0L;
+constexpr long double kMillerRabinNs=1400.0L;
+// Mertens: the share of integers without a prime factor up to B is about
+// kMertensFactor/ln(B).
+constexpr long double kMertensFactor=0.5615L;
+
 const SmallPrimePattern*find_small_pattern(const Wheel&wheel,std::uint32_t prime) {
     for(const auto&pattern : wheel.small_patterns) {
         if(pattern.prime==prime) {
@@ -20,132 +177,260 @@ const SmallPrimePattern*find_small_pattern(const Wheel&wheel,std::uint32_t prime
 
 }
 
-std::uint64_t PrimeMarker::first_hit(std::uint32_t prime,std::uint64_t start) {
-    std::uint64_t begin=static_cast<std::uint64_t>(prime)*static_cast<std::uint64_t>(prime);
-    if(begin<start) {
-        begin=start;
+std::uint64_t hybrid_sieve_bound(HybridMode mode,const SegmentConfig&config,std::uint64_t range_begin,std::uint64_t range_end,bool cached_primes) {
+    if(mode==HybridMode::Off||range_end<=range_begin) {
+        return 0;
     }
-    std::uint64_t remainder=begin%prime;
-    if(remainder) {
-        begin+=prime-remainder;
+    std::uint64_t bound=config.tile_span/2ULL;
+    long double root=std::sqrt(static_cast<long double>(range_end-1));
+    if(bound<2||static_cast<long double>(bound)>=root) {
+        return 0;
     }
-    if((begin&1ULL)==0) {
-        begin+=prime;
+    if(mode==HybridMode::On) {
+        return bound;
     }
-    return begin;
+    long double large_primes=root/std::log(root)-static_cast<long double>(bound)/std::log(static_cast<long double>(bound));
+    long double sieve_cost=large_primes*(kScanNsPerPrime+(cached_primes?0.0L:kGenerateNsPerPrime));
+    long double candidates=static_cast<long double>(range_end-range_begin)*kMertensFactor/std::log(static_cast<long double>(bound));
+    return candidates*kMillerRabinNs<sieve_cost?bound:0;
+}
+
+MediumPrimeState PrimeMarker::medium_position(const FastDivider&prime,std::uint64_t start) const {
+    MediumPrimeState state{};
+    std::uint64_t m=ceil_multiplier(prime,start);
+    if(wheel_.type==WheelType::Mod30) {
+        state.next_value=first_wheel_hit(kHitWheel30,prime.divisor,m,state.wheel_index);
+    } else {
+        state.next_value=first_wheel_hit(kHitWheel210,prime.divisor,m,state.wheel_index);
+    }
+    return state;
+}
+
+PackedPrimeState PrimeMarker::packed_position(const FastDivider&prime,std::uint64_t start) const {
+    PackedPrimeState state{};
+    std::uint64_t value=first_wheel_hit(kHitWheel30,prime.divisor,ceil_multiplier(prime,start),state.wheel_index);
+    state.byte=(value-segment_origin_)/30;
+    return state;
+}
+
+TilePrimeState PrimeMarker::tile_position(const FastDivider&prime,std::uint64_t start) const {
+    TilePrimeState state{};
+    std::uint64_t value=first_wheel_hit(kHitWheel30,prime.divisor,ceil_multiplier(prime,start),state.wheel_index);
+    state.next_unit=packed()?(value-segment_origin_)/30:(value-segment_origin_)>>1;
+    return state;
 }
 
-PrimeMarker::PrimeMarker(const Wheel&wheel,SegmentConfig config,std::uint64_t range_begin,std::uint64_t range_end,const std::vector<std::uint32_t>&primes,std::uint32_t small_prime_limit)
-    : wheel_(wheel),config_(config),range_begin_(range_begin),range_end_(range_end) {
+PrimeMarker::PrimeMarker(const Wheel&wheel,SegmentConfig config,std::uint64_t range_begin,std::uint64_t range_end,const BasePrimes&primes,std::uint32_t small_prime_limit,unsigned threads)
+    : wheel_(wheel),config_(config),range_begin_(range_begin),range_end_(range_end),
+      segment_origin_(segment_origin(range_begin,config)),packed_presieve_(nullptr) {
+    // Primes up to half a tile span are stepped through every tile; above
+    // that they hit a tile at most about once and go to per-tile buckets;
+    // above half a segment span they go to the segment buckets.
     std::uint64_t large_threshold=config_.segment_span/2ULL;
-    for(std::uint32_t prime : primes) {
-        if(prime<2) {
+    std::uint64_t tile_threshold=std::min<std::uint64_t>(config_.tile_span/2ULL,large_threshold);
+    std::uint32_t presieve_limit=wheel_.presieve_primes.empty()?2u:wheel_.presieve_primes.back();
+    if(packed()) {
+        // The byte layout has its own presieve and no word-pattern tier:
+        // everything above the presieve is crossed off by wheel steps.
+        packed_presieve_=&get_packed_presieve();
+        presieve_limit=std::max(presieve_limit,packed_presieve_->primes.back());
+        small_prime_limit=0;
+    }
+    BasePrimes::Reader reader=primes.reader();
+    std::size_t first_large=0;
+    for(;first_large<primes.size();++first_large) {
+        std::uint32_t prime=reader.next();
+        if(prime<=presieve_limit) {
             continue;
         }
-        if(prime==2) {
-            continue;
+        if(static_cast<std::uint64_t>(prime)>large_threshold) {
+            break;
         }
-        if(prime<=small_prime_limit) {
-            small_primes_.push_back(prime);
-            small_initial_.push_back(first_hit(prime,range_begin_));
-            small_prime_patterns_.push_back(find_small_pattern(wheel_,prime));
-        } else if(static_cast<std::uint64_t>(prime)<=large_threshold) {
+        const SmallPrimePattern*pattern=prime<=small_prime_limit?find_small_pattern(wheel_,prime):nullptr;
+        if(pattern) {
+            small_prime_patterns_.push_back(pattern);
+            small_dividers_.emplace_back(prime);
+        } else if(static_cast<std::uint64_t>(prime)<=tile_threshold) {
             medium_primes_.push_back(prime);
-            medium_initial_.push_back(first_hit(prime,range_begin_));
+            medium_dividers_.emplace_back(prime);
         } else {
-            LargePrimeState state;
-            state.prime=prime;
-            state.stride=static_cast<std::uint64_t>(prime)*2ULL;
-            state.next_value=first_hit(prime,range_begin_);
-            large_primes_template_.push_back(state);
+            tile_primes_.push_back(prime);
+            tile_dividers_.emplace_back(prime);
         }
     }
+
+    // Large primes step through the mod-30 wheel in both layouts. Bucket
+    // entries hold positions in segment units: bits of the odd-only bitset
+    // or bytes of the packed layout.
+    segment_units_=packed()?config_.segment_bytes:config_.segment_span/2ULL;
+    tile_units_=packed()?config_.tile_bytes:config_.tile_span/2ULL;
+    tiles_per_segment_=tile_units_?static_cast<std::size_t>((segment_units_+tile_units_-1)/tile_units_):1;
+    segment_divider_=FastDivider(segment_units_?segment_units_:1);
+    tile_divider_=FastDivider(tile_units_?tile_units_:1);
+    std::uint64_t covered=range_end_>segment_origin_?range_end_-segment_origin_:0;
+    segment_count_=config_.segment_span?(covered+config_.segment_span-1)/config_.segment_span:0;
+    filter_large_primes(primes,first_large,threads);
+    // Every composite below range_end_ has a prime factor no larger than
+    // the integer square root of its largest value.
+    std::uint64_t top=range_end_>0?range_end_-1:0;
+    std::uint64_t root=std::min<std::uint64_t>(static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(top))),0xFFFFFFFFULL);
+    while(root*root>top) {
+        --root;
+    }
+    while(root<0xFFFFFFFFULL&&(root+1)*(root+1)<=top) {
+        ++root;
+    }
+    confirm_candidates_=primes.limit()<root;
+    std::uint64_t max_prime=large_primes_.empty()?0:large_primes_.back();
+    std::uint64_t max_step=packed()?max_prime/30*6+6:max_prime*3;
+    bucket_distance_=segment_units_?static_cast<std::size_t>(max_step/segment_units_+2):1;
 }
 
-PrimeMarker::ThreadState PrimeMarker::make_thread_state(std::size_t thread_index,std::size_t thread_count) const {
-    ThreadState state;
-    state.bucket.reset(0);
-    state.small_positions=small_initial_;
-    state.medium_positions=medium_initial_;
-    std::size_t count=0;
-    for(std::size_t i=0;i<large_primes_template_.size();++i) {
-        if(i%thread_count==thread_index) {
-            ++count;
+void PrimeMarker::filter_large_primes(const BasePrimes&primes,std::size_t first,unsigned threads) {
+    // Threads admit large primes at their first segment, so every prime they
+    // carry costs each of them a first-hit computation. Primes with no
+    // multiple below range_end_ are dropped here once, split across the
+    // worker threads; on a narrow range far from zero that is nearly all.
+    // Of the rest, primes p with 2p>=reach have exactly one hit, since wheel
+    // multiples are at least 2p apart: it is recorded here and never bucketed.
+    std::uint64_t reach=range_end_>segment_origin_?range_end_-segment_origin_:0;
+    std::uint64_t sparse_threshold=reach/2+(reach&1ULL);
+    std::size_t count=primes.size()-first;
+    std::size_t workers=std::min<std::size_t>(threads?threads:1,count/kMinFilterPrimesPerThread+1);
+    std::vector<std::vector<std::uint32_t>>kept(workers);
+    std::vector<std::vector<std::uint64_t>>sparse(workers);
+    auto filter=[&](std::size_t worker) {
+        std::size_t begin=count*worker/workers;
+        std::size_t end=count*(worker+1)/workers;
+        BasePrimes::Reader reader=primes.reader(first+begin);
+        std::array<std::uint32_t,kFirstHitBatch>batch_primes;
+        std::array<std::uint64_t,kFirstHitBatch>distances;
+        std::array<std::uint32_t,kFirstHitBatch>wheel_indices;
+        for(std::size_t batch=begin;batch<end;batch+=kFirstHitBatch) {
+            std::size_t n=std::min(kFirstHitBatch,end-batch);
+            for(std::size_t k=0;k<n;++k) {
+                batch_primes[k]=reader.next();
+            }
+            first_wheel30_hits(batch_primes.data(),n,segment_origin_,distances.data(),wheel_indices.data());
+            for(std::size_t k=0;k<n;++k) {
+                std::uint64_t distance=distances[k];
+                if(distance>=reach) {
+                    continue;
+                }
+                if(batch_primes[k]<sparse_threshold) {
+                    kept[worker].push_back(batch_primes[k]);
+                } else if(packed()) {
+                    std::uint64_t byte=distance/30;
+                    sparse[worker].push_back(byte*8+kWheel30BitIndex[distance-byte*30]);
+                } else {
+                    sparse[worker].push_back(distance>>1);
+                }
+            }
         }
+    };
+    std::vector<std::thread>pool;
+    for(std::size_t worker=1;worker<workers;++worker) {
+        pool.emplace_back(filter,worker);
     }
-    state.large_states.reserve(count);
-    for(std::size_t i=0;i<large_primes_template_.size();++i) {
-        if(i%thread_count!=thread_index) {
-            continue;
+    filter(0);
+    for(auto&thread : pool) {
+        thread.join();
+    }
+    std::size_t total=0;
+    for(const auto&part : kept) {
+        total+=part.size();
+    }
+    large_primes_.reserve(total);
+    for(const auto&part : kept) {
+        large_primes_.insert(large_primes_.end(),part.begin(),part.end());
+    }
+
+    // Group the single hits by segment with a counting sort.
+    std::size_t hits=0;
+    for(const auto&part : sparse) {
+        hits+=part.size();
+    }
+    if(hits==0) {
+        return;
+    }
+    unsigned unit_shift=packed()?3u:0u;
+    std::uint64_t segment_bits=segment_units_<<unit_shift;
+    sparse_offsets_.assign(static_cast<std::size_t>(segment_count_)+1,0);
+    for(const auto&part : sparse) {
+        for(std::uint64_t bit : part) {
+            ++sparse_offsets_[static_cast<std::size_t>(segment_divider_.divide(bit>>unit_shift))+1];
         }
-        state.large_states.push_back(large_primes_template_[i]);
-        auto&lp=state.large_states.back();
-        if(lp.next_value>=range_end_) {
-            continue;
+    }
+    std::partial_sum(sparse_offsets_.begin(),sparse_offsets_.end(),sparse_offsets_.begin());
+    std::vector<std::size_t>cursor(sparse_offsets_.begin(),sparse_offsets_.end()-1);
+    sparse_hits_.resize(hits);
+    for(const auto&part : sparse) {
+        for(std::uint64_t bit : part) {
+            std::uint64_t segment=segment_divider_.divide(bit>>unit_shift);
+            sparse_hits_[cursor[static_cast<std::size_t>(segment)]++]=static_cast<std::uint32_t>(bit-segment*segment_bits);
         }
-        std::uint64_t segment=(lp.next_value-range_begin_)/config_.segment_span;
-        std::uint64_t base=range_begin_+segment*config_.segment_span;
-        if((base&1ULL)==0) {
-            ++base;
+    }
+}
+
+PrimeMarker::ThreadState PrimeMarker::make_thread_state(std::uint64_t first_segment) const {
+    // Every thread carries all sieving primes, positioned at the start of
+    // the first segment it will sieve; large primes join the buckets lazily.
+    ThreadState state;
+    state.bucket.reset(first_segment,bucket_distance_);
+    std::uint64_t start=segment_origin_+first_segment*config_.segment_span;
+    if(start<range_begin_) {
+        start=range_begin_;
+    }
+    state.tile_bucket.reset(0,tiles_per_segment_);
+    state.tile_positions.reserve(tile_primes_.size());
+    for(const FastDivider&prime : tile_dividers_) {
+        state.tile_positions.push_back(tile_position(prime,start));
+    }
+    if(packed()) {
+        state.packed_positions.reserve(medium_primes_.size());
+        for(const FastDivider&prime : medium_dividers_) {
+            state.packed_positions.push_back(packed_position(prime,start));
+        }
+    } else {
+        state.medium_positions.reserve(medium_primes_.size());
+        for(const FastDivider&prime : medium_dividers_) {
+            state.medium_positions.push_back(medium_position(prime,start));
         }
-        std::uint64_t offset=(lp.next_value-base)>>1;
-        state.bucket.push(segment,BucketEntry{lp.prime,segment,offset,lp.next_value,&lp});
     }
     return state;
 }
 
-void PrimeMarker::apply_small_primes(ThreadState&state,const TileView&tile) const {
-    if(tile.bit_count==0) {
+void PrimeMarker::apply_small_primes(const TileView&tile) const {
+    if(tile.bit_count==0||small_prime_patterns_.empty()) {
         return;
     }
     std::uint64_t tile_end=tile.start_value+tile.bit_count*2ULL;
-    for(std::size_t i=0;i<small_primes_.size();++i) {
-        std::uint32_t prime=small_primes_[i];
-        std::uint64_t step=static_cast<std::uint64_t>(prime)*2ULL;
-        std::uint64_t pos=state.small_positions[i];
-        if(pos<tile.start_value) {
-            std::uint64_t delta=tile.start_value-pos;
-            std::uint64_t skip=(delta+step-1)/step;
-            pos+=skip*step;
-        }
-        if(pos>=tile_end) {
-            state.small_positions[i]=pos;
-            continue;
-        }
-        const SmallPrimePattern*pattern=small_prime_patterns_[i];
-        if(pattern) {
-            std::size_t bit_index=static_cast<std::size_t>((pos-tile.start_value)>>1);
-            std::size_t word_index=bit_index/64;
-            if(word_index<tile.word_count) {
-                std::size_t bit_in_word=bit_index%64;
-                std::uint32_t phase=pattern->start_phase[bit_in_word];
-                std::uint64_t*word_ptr=tile.word_ptr+word_index;
-                std::uint64_t*word_end=tile.word_ptr+tile.word_count;
-                std::uint64_t mask=pattern->masks[phase];
-                if(bit_in_word!=0) {
-                    mask&=(~0ULL)<<bit_in_word;
-                }
-                word_ptr[0]|=mask;
-                phase=pattern->next_phase[phase];
-                for(++word_ptr;word_ptr<word_end;++word_ptr) {
-                    word_ptr[0]|=pattern->masks[phase];
-                    phase=pattern->next_phase[phase];
-                }
-            }
-            std::uint64_t delta=tile_end-pos;
-            std::uint64_t skip=(delta+step-1)/step;
-            pos+=skip*step;
-            state.small_positions[i]=pos;
-        } else {
-            std::uint64_t current=pos;
-            while(current<tile_end) {
-                std::size_t bit_index=(current-tile.start_value)>>1;
-                std::size_t word=bit_index/64;
-                std::size_t bit=bit_index%64;
-                tile.word_ptr[word]|=(1ULL<<bit);
-                current+=step;
+    std::size_t count=small_prime_patterns_.size();
+    const KernelTable&kernels=active_kernels();
+    for(std::size_t group=0;group<count;group+=kSmallStreamGroup) {
+        std::array<const std::uint64_t*,kSmallStreamGroup>streams;
+        std::array<std::uint32_t,kSmallStreamGroup>periods;
+        std::array<std::uint32_t,kSmallStreamGroup>cursors;
+        for(std::size_t k=0;k<kSmallStreamGroup;++k) {
+            if(group+k<count) {
+                const SmallPrimePattern&pattern=*small_prime_patterns_[group+k];
+                streams[k]=pattern.stream.data();
+                periods[k]=pattern.prime;
+                cursors[k]=pattern.stream_index[small_dividers_[group+k].remainder(tile.start_value)];
+            } else {
+                streams[k]=kZeroStream.data();
+                periods[k]=kZeroStreamPeriod;
+                cursors[k]=0;
             }
-            state.small_positions[i]=current;
+        }
+        kernels.or_small_streams(tile.word_ptr,tile.word_count,streams.data(),periods.data(),cursors.data());
+    }
+    // The streams mark every odd multiple, the small primes themselves included.
+    for(const SmallPrimePattern*pattern : small_prime_patterns_) {
+        std::uint64_t prime=pattern->prime;
+        if(prime>=tile.start_value&&prime<tile_end) {
+            std::size_t bit=static_cast<std::size_t>((prime-tile.start_value)>>1);
+            tile.word_ptr[bit/64]&=~(1ULL<<(bit%64));
         }
     }
 }
@@ -156,52 +441,169 @@ void PrimeMarker::apply_medium_primes(ThreadState&state,const TileView&tile,std:
         return;
     }
     std::uint64_t tile_end=tile.start_value+tile.bit_count*2ULL;
+    bool wheel30=wheel_.type==WheelType::Mod30;
     for(std::size_t i=0;i<medium_primes_.size();++i) {
         std::uint32_t prime=medium_primes_[i];
-        std::uint64_t step=static_cast<std::uint64_t>(prime)*2ULL;
-        std::uint64_t pos=state.medium_positions[i];
-        if(pos<tile.start_value) {
-            std::uint64_t delta=tile.start_value-pos;
-            std::uint64_t skip=(delta+step-1)/step;
-            pos+=skip*step;
-        }
-        while(pos<tile_end) {
-            std::size_t bit_index=(pos-tile.start_value)>>1;
-            std::size_t word=bit_index/64;
-            std::size_t bit=bit_index%64;
-            tile.word_ptr[word]|=(1ULL<<bit);
-            pos+=step;
-        }
-        state.medium_positions[i]=pos;
+        MediumPrimeState&pos=state.medium_positions[i];
+        if(pos.next_value<tile.start_value) {
+            pos=medium_position(medium_dividers_[i],tile.start_value);
+        }
+        if(pos.next_value>=tile_end) {
+            continue;
+        }
+        std::size_t bit=static_cast<std::size_t>((pos.next_value-tile.start_value)>>1);
+        if(wheel30) {
+            cross_off_wheel(kHitWheel30,tile.word_ptr,tile.bit_count,prime,bit,pos.wheel_index);
+        } else {
+            cross_off_wheel(kHitWheel210,tile.word_ptr,tile.bit_count,prime,bit,pos.wheel_index);
+        }
+        pos.next_value=tile.start_value+static_cast<std::uint64_t>(bit)*2ULL;
     }
 }
 
-void PrimeMarker::apply_large_primes(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset) const {
-    auto hits=state.bucket.take(segment_id);
-    for(auto&entry : hits) {
-        if(entry.value>=segment_low&&entry.value<segment_high) {
-            std::size_t bit_index=(entry.value-segment_low)>>1;
-            bitset[bit_index/64]|=(1ULL<<(bit_index%64));
+void PrimeMarker::fill_tile_buckets(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::size_t limit) const {
+    // Tile-tier primes hit every segment but only a few of its tiles. Each
+    // one is filed under the tile of its first hit here and re-filed after
+    // every hit, so a tile only sees the primes that land in it.
+    std::uint64_t base=segment_id*segment_units_;
+    std::uint64_t start=std::max(segment_low,range_begin_);
+    for(std::size_t i=0;i<tile_primes_.size();++i) {
+        TilePrimeState&pos=state.tile_positions[i];
+        if(pos.next_unit<base) {
+            pos=tile_position(tile_dividers_[i],start);
         }
-        if(!entry.owner) {
-            continue;
+        std::uint64_t unit=pos.next_unit-base;
+        if(unit<limit) {
+            std::uint64_t tile=tile_divider_.divide(unit);
+            state.tile_bucket.push(tile,make_bucket_entry(static_cast<std::uint32_t>(i),static_cast<std::uint32_t>(unit-tile*tile_units_),pos.wheel_index));
         }
-        std::uint64_t next=entry.value+entry.owner->stride;
-        entry.owner->next_value=next;
-        if(next>=range_end_) {
-            continue;
+    }
+}
+
+void PrimeMarker::apply_tile_primes(ThreadState&state,std::uint64_t segment_id,std::size_t tile,std::size_t limit,std::uint64_t*bits) const {
+    BucketBlock*blocks=state.tile_bucket.take(tile);
+    std::uint8_t*bytes=reinterpret_cast<std::uint8_t*>(bits);
+    std::uint64_t tile_base=tile*tile_units_;
+    std::uint64_t tile_end=std::min<std::uint64_t>(tile_base+tile_units_,limit);
+    for(BucketBlock*block=blocks;block;block=block->next) {
+        for(std::uint32_t i=0;i<block->count;++i) {
+            BucketEntry entry=block->entries[i];
+            std::uint64_t prime=tile_primes_[entry.prime_index];
+            std::uint64_t unit=tile_base+(entry.offset_wheel>>kBucketWheelBits);
+            std::uint32_t wheel=entry.offset_wheel&7u;
+            if(packed()) {
+                const auto&steps=kPackedSteps[kWheel30BitIndex[prime%30]];
+                std::uint64_t quotient=prime/30;
+                while(unit<tile_end) {
+                    bytes[unit]|=steps[wheel].mask;
+                    unit+=quotient*kWheel30Gaps[wheel]+steps[wheel].extra;
+                    wheel=(wheel+1)&7u;
+                }
+            } else {
+                while(unit<tile_end) {
+                    bits[unit>>6]|=1ULL<<(unit&63);
+                    unit+=prime*kHitWheel30.half_gaps[wheel];
+                    wheel=(wheel+1)&7u;
+                }
+            }
+            if(unit<limit) {
+                std::uint64_t next_tile=tile_divider_.divide(unit);
+                state.tile_bucket.push(next_tile,make_bucket_entry(entry.prime_index,static_cast<std::uint32_t>(unit-next_tile*tile_units_),wheel));
+            } else {
+                state.tile_positions[entry.prime_index]=TilePrimeState{segment_id*segment_units_+unit,wheel};
+            }
+        }
+    }
+    state.tile_bucket.release(blocks);
+}
+
+void PrimeMarker::apply_sparse_hits(std::uint64_t segment_id,std::uint64_t*bits) const {
+    if(sparse_offsets_.empty()) {
+        return;
+    }
+    std::size_t end=sparse_offsets_[static_cast<std::size_t>(segment_id)+1];
+    for(std::size_t i=sparse_offsets_[static_cast<std::size_t>(segment_id)];i<end;++i) {
+        std::uint32_t bit=sparse_hits_[i];
+        bits[bit>>6]|=1ULL<<(bit&63);
+    }
+}
+
+void PrimeMarker::apply_large_primes(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset) const {
+    apply_sparse_hits(segment_id,bitset.data());
+
+    // Segments handed to other threads still have to move this thread's
+    // entries forward, without marking anything.
+    for(std::uint64_t skipped=state.bucket.base_segment();skipped<segment_id;++skipped) {
+        advance_bucket(state,skipped,0,nullptr);
+    }
+
+    // Primes join the buckets once their square reaches the current segment.
+    std::size_t end=static_cast<std::size_t>(std::partition_point(large_primes_.begin()+static_cast<std::ptrdiff_t>(state.next_large),large_primes_.end(),[segment_high](std::uint32_t prime) {
+        return static_cast<std::uint64_t>(prime)*prime<segment_high;
+    })-large_primes_.begin());
+    std::uint64_t reach=range_end_>segment_low?range_end_-segment_low:0;
+    std::array<std::uint64_t,kFirstHitBatch>distances;
+    std::array<std::uint32_t,kFirstHitBatch>wheel_indices;
+    for(std::size_t batch=state.next_large;batch<end;batch+=kFirstHitBatch) {
+        std::size_t n=std::min(kFirstHitBatch,end-batch);
+        first_wheel30_hits(large_primes_.data()+batch,n,segment_low,distances.data(),wheel_indices.data());
+        for(std::size_t k=0;k<n;++k) {
+            if(distances[k]>=reach) {
+                continue;
+            }
+            std::uint64_t units=packed()?distances[k]/30:distances[k]>>1;
+            std::uint64_t skip=segment_divider_.divide(units);
+            std::uint32_t offset=static_cast<std::uint32_t>(units-skip*segment_units_);
+            state.bucket.push(segment_id+skip,make_bucket_entry(static_cast<std::uint32_t>(batch+k),offset,wheel_indices[k]));
         }
-        std::uint64_t seg=(next-range_begin_)/config_.segment_span;
-        std::uint64_t base=range_begin_+seg*config_.segment_span;
-        if((base&1ULL)==0) {
-            ++base;
+    }
+    state.next_large=end;
+
+    std::size_t limit=packed()?static_cast<std::size_t>((segment_high-segment_low+29)/30):
+                                 static_cast<std::size_t>((segment_high-segment_low)>>1);
+    advance_bucket(state,segment_id,limit,bitset.data());
+}
+
+void PrimeMarker::advance_bucket(ThreadState&state,std::uint64_t segment_id,std::size_t limit,std::uint64_t*bits) const {
+    BucketBlock*blocks=state.bucket.take(segment_id);
+    std::uint8_t*bytes=reinterpret_cast<std::uint8_t*>(bits);
+    for(BucketBlock*block=blocks;block;block=block->next) {
+        for(std::uint32_t i=0;i<block->count;++i) {
+            BucketEntry entry=block->entries[i];
+            std::uint64_t prime=large_primes_[entry.prime_index];
+            std::uint32_t offset=entry.offset_wheel>>kBucketWheelBits;
+            std::uint32_t wheel=entry.offset_wheel&7u;
+            std::uint64_t next=offset;
+            if(packed()) {
+                const PackedStep&step=kPackedSteps[kWheel30BitIndex[prime%30]][wheel];
+                if(offset<limit) {
+                    bytes[offset]|=step.mask;
+                }
+                next+=prime/30*kWheel30Gaps[wheel]+step.extra;
+            } else {
+                if(offset<limit) {
+                    bits[offset>>6]|=1ULL<<(offset&63);
+                }
+                next+=prime*kHitWheel30.half_gaps[wheel];
+            }
+            std::uint64_t skip=segment_divider_.divide(next);
+            std::uint64_t seg=segment_id+skip;
+            if(seg>=segment_count_) {
+                continue;
+            }
+            state.bucket.push(seg,make_bucket_entry(entry.prime_index,static_cast<std::uint32_t>(next-skip*segment_units_),(wheel+1)&7u));
         }
-        std::uint64_t offset=(next-base)>>1;
-        state.bucket.push(seg,BucketEntry{entry.owner->prime,seg,offset,next,entry.owner});
     }
+    state.bucket.release(blocks);
 }
 
-void PrimeMarker::sieve_segment(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset) const {
+void PrimeMarker::sieve_segment(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset,SegmentCounts*counts) const {
+    if(counts) {
+        counts->total=0;
+        if(counts->tile_counts) {
+            counts->tile_counts->clear();
+        }
+    }
     if(segment_high<=segment_low) {
         bitset.clear();
         return;
@@ -211,46 +613,178 @@ void PrimeMarker::sieve_segment(ThreadState&state,std::uint64_t segment_id,std::
         bitset.clear();
         return;
     }
+    if(packed()) {
+        sieve_packed_segment(state,segment_id,segment_low,segment_high,bitset,counts);
+        return;
+    }
     std::size_t word_count=words_for_bits(bit_count);
-    bitset.assign(word_count,0);
+    bitset.resize(word_count);
 
-    wheel_.apply_presieve(segment_low,bit_count,bitset.data());
+    wheel_.fill_presieve(segment_low,bit_count,bitset.data());
     apply_large_primes(state,segment_id,segment_low,segment_high,bitset);
 
+    fill_tile_buckets(state,segment_id,segment_low,bit_count);
+
+    const KernelTable&kernels=active_kernels();
     std::uint64_t tile_low=segment_low;
     std::size_t bit_offset=0;
-    while(tile_low<segment_high) {
-        std::uint64_t tile_high=std::min<std::uint64_t>(segment_high,tile_low+config_.tile_span);
+    for(std::size_t tile_index=0;tile_low<segment_high;++tile_index) {
+        std::uint64_t tile_high=tile_low+std::min<std::uint64_t>(segment_high-tile_low,config_.tile_span);
         std::size_t tile_bits=static_cast<std::size_t>((tile_high-tile_low)>>1);
         std::size_t tile_words=words_for_bits(tile_bits);
         TileView tile{tile_low,bit_offset,tile_bits,bitset.data()+(bit_offset/64),tile_words};
-        apply_small_primes(state,tile);
+        apply_small_primes(tile);
         apply_medium_primes(state,tile,segment_id);
+        apply_tile_primes(state,segment_id,tile_index,bit_count,bitset.data());
         if(tile_bits%64!=0&&tile_words>0) {
             std::uint64_t mask=(1ULL<<(tile_bits%64))-1;
             tile.word_ptr[tile_words-1]&=mask;
         }
+        if(confirm_candidates_) {
+            confirm_odd_bits(tile.word_ptr,tile_bits,tile_low);
+        }
+        if(counts) {
+            std::uint64_t tile_count=kernels.count_zero_bits(tile.word_ptr,tile_bits);
+            counts->total+=tile_count;
+            if(counts->tile_counts) {
+                counts->tile_counts->push_back(static_cast<std::uint32_t>(tile_count));
+            }
+        }
         tile_low=tile_high;
         bit_offset+=tile_bits;
     }
+}
 
-    std::uint64_t segment_end=segment_high;
+void PrimeMarker::confirm_odd_bits(std::uint64_t*words,std::size_t bit_count,std::uint64_t low) const {
+    for(std::size_t w=0;w*64<bit_count;++w) {
+        std::uint64_t candidates=~words[w];
+        if(bit_count-w*64<64) {
+            candidates&=(1ULL<<(bit_count-w*64))-1;
+        }
+        while(candidates) {
+            unsigned bit=static_cast<unsigned>(std::countr_zero(candidates));
+            candidates&=candidates-1;
+            if(!miller_rabin_is_prime(low+2ULL*(w*64+bit))) {
+                words[w]|=1ULL<<bit;
+            }
+        }
+    }
+}
+
+void PrimeMarker::confirm_wheel30_bytes(std::uint8_t*bytes,std::size_t byte_count,std::uint64_t low) const {
+    for(std::size_t i=0;i<byte_count;++i) {
+        unsigned candidates=static_cast<std::uint8_t>(~bytes[i]);
+        while(candidates) {
+            unsigned bit=static_cast<unsigned>(std::countr_zero(candidates));
+            candidates&=candidates-1;
+            if(!miller_rabin_is_prime(low+30ULL*i+kWheel30Residues[bit])) {
+                bytes[i]|=static_cast<std::uint8_t>(1u<<bit);
+            }
+        }
+    }
+}
+
+void PrimeMarker::apply_packed_primes(ThreadState&state,std::uint64_t tile_byte,std::size_t tile_bytes,std::uint8_t*bytes) const {
+    std::uint64_t tile_end=tile_byte+tile_bytes;
     for(std::size_t i=0;i<medium_primes_.size();++i) {
-        std::uint64_t step=static_cast<std::uint64_t>(medium_primes_[i])*2ULL;
-        if(state.medium_positions[i]<segment_end) {
-            std::uint64_t delta=segment_end-state.medium_positions[i];
-            std::uint64_t skip=(delta+step-1)/step;
-            state.medium_positions[i]+=skip*step;
+        std::uint32_t prime=medium_primes_[i];
+        PackedPrimeState&pos=state.packed_positions[i];
+        if(pos.byte<tile_byte) {
+            pos=packed_position(medium_dividers_[i],segment_origin_+tile_byte*30ULL);
+        }
+        const auto&steps=kPackedSteps[kWheel30BitIndex[prime%30]];
+        std::uint64_t quotient=prime/30;
+        std::uint64_t byte=pos.byte;
+        std::uint32_t wheel=pos.wheel_index;
+        while(byte<tile_end) {
+            bytes[byte-tile_byte]|=steps[wheel].mask;
+            byte+=quotient*kWheel30Gaps[wheel]+steps[wheel].extra;
+            wheel=(wheel+1)&7u;
         }
+        pos.byte=byte;
+        pos.wheel_index=wheel;
     }
-    for(std::size_t i=0;i<small_primes_.size();++i) {
-        std::uint64_t step=static_cast<std::uint64_t>(small_primes_[i])*2ULL;
-        if(state.small_positions[i]<segment_end) {
-            std::uint64_t delta=segment_end-state.small_positions[i];
-            std::uint64_t skip=(delta+step-1)/step;
-            state.small_positions[i]+=skip*step;
+}
+
+void PrimeMarker::sieve_packed_segment(ThreadState&state,std::uint64_t segment_id,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&bitset,SegmentCounts*counts) const {
+    // Segment bounds are multiples of 30 away from the origin, so every byte
+    // belongs to exactly one segment.
+    std::size_t byte_count=static_cast<std::size_t>((segment_high-segment_low+29)/30);
+    std::size_t word_count=(byte_count+7)/8;
+    bitset.resize(word_count);
+    std::uint8_t*bytes=reinterpret_cast<std::uint8_t*>(bitset.data());
+    packed_presieve_->fill(segment_low/30,byte_count,bytes);
+    std::memset(bytes+byte_count,0xFF,word_count*sizeof(std::uint64_t)-byte_count);
+
+    apply_large_primes(state,segment_id,segment_low,segment_high,bitset);
+
+    // Values outside the range are struck before the tile pass so each tile
+    // is final, and countable, once its medium primes are done.
+    std::uint64_t last_base=segment_low+static_cast<std::uint64_t>(byte_count-1)*30ULL;
+    for(std::size_t b=0;b<kWheel30Residues.size();++b) {
+        if(segment_low+kWheel30Residues[b]<range_begin_) {
+            bytes[0]|=static_cast<std::uint8_t>(1u<<b);
         }
+        if(kWheel30Residues[b]>=segment_high-last_base) {
+            bytes[byte_count-1]|=static_cast<std::uint8_t>(1u<<b);
+        }
+    }
+
+    fill_tile_buckets(state,segment_id,segment_low,byte_count);
+
+    const KernelTable&kernels=active_kernels();
+    std::uint64_t first_byte=(segment_low-segment_origin_)/30;
+    for(std::size_t done=0;done<byte_count;) {
+        std::size_t tile_bytes=std::min(config_.tile_bytes,byte_count-done);
+        apply_packed_primes(state,first_byte+done,tile_bytes,bytes+done);
+        apply_tile_primes(state,segment_id,done/config_.tile_bytes,byte_count,bitset.data());
+        if(confirm_candidates_) {
+            confirm_wheel30_bytes(bytes+done,tile_bytes,segment_low+done*30ULL);
+        }
+        if(counts) {
+            // Tiles are multiples of 128 bytes, so each starts on a word.
+            std::uint64_t tile_count=kernels.count_zero_bits(bitset.data()+done/8,tile_bytes*8);
+            counts->total+=tile_count;
+            if(counts->tile_counts) {
+                counts->tile_counts->push_back(static_cast<std::uint32_t>(tile_count));
+            }
+        }
+        done+=tile_bytes;
+    }
+}
+
+std::size_t PrimeMarker::segment_bits(std::uint64_t segment_low,std::uint64_t segment_high) const {
+    if(segment_high<=segment_low) {
+        return 0;
+    }
+    if(packed()) {
+        return static_cast<std::size_t>((segment_high-segment_low+29)/30)*8;
+    }
+    return static_cast<std::size_t>((segment_high-segment_low)>>1);
+}
+
+void PrimeMarker::collect_primes(const std::vector<std::uint64_t>&bitset,std::uint64_t segment_low,std::uint64_t segment_high,std::vector<std::uint64_t>&primes) const {
+    std::size_t bit_count=segment_bits(segment_low,segment_high);
+    if(bit_count==0) {
+        return;
+    }
+    // Count first so the output grows once, then let the kernel write in place.
+    std::size_t offset=primes.size();
+    primes.resize(offset+static_cast<std::size_t>(active_kernels().count_zero_bits(bitset.data(),bit_count)));
+    extract_primes(bitset,segment_low,segment_high,primes.data()+offset);
+}
+
+std::size_t PrimeMarker::extract_primes(const std::vector<std::uint64_t>&bitset,std::uint64_t segment_low,std::uint64_t segment_high,std::uint64_t*out) const {
+    std::size_t bit_count=segment_bits(segment_low,segment_high);
+    if(bit_count==0) {
+        return 0;
+    }
+    const KernelTable&kernels=active_kernels();
+    if(packed()) {
+        const std::uint8_t*bytes=reinterpret_cast<const std::uint8_t*>(bitset.data());
+        return kernels.extract_wheel30_bytes(bytes,bit_count/8,segment_low,out);
     }
+    return kernels.extract_odd_bits(bitset.data(),bit_count,segment_low,out);
 }
 
 }
@@ -0,0 +1,272 @@
+#include "nth_prime.h"
+
+#include "base_sieve.h"
+#include "cpu_info.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+namespace calcprime {
+namespace {
+
+// Below this the prime is read off a plain list, which also covers the
+// presieved primes that segments never report.
+constexpr std::uint64_t kListLimit=1ULL<<16;
+// Segments per window, which bounds the per-segment records.
+constexpr std::uint64_t kMaxWindowSegments=1ULL<<18;
+
+std::uint64_t integer_sqrt(std::uint64_t n) {
+    std::uint64_t root=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(n)));
+    while(root>0&&root>n/root) {
+        --root;
+    }
+    while(root+1<=n/(root+1)) {
+        ++root;
+    }
+    return root;
+}
+
+std::uint64_t saturating_add(std::uint64_t a,std::uint64_t b) {
+    return a>std::numeric_limits<std::uint64_t>::max()-b?std::numeric_limits<std::uint64_t>::max():a+b;
+}
+
+// li(x) for x>1 by Ramanujan's series.
+long double log_integral(long double x) {
+    constexpr long double kEulerGamma=0.5772156649015328606065120900824024L;
+    long double ln=std::log(x);
+    long double sum=0.0L;
+    long double power=2.0L;
+    long double inner=0.0L;
+    for(int n=1;n<256;++n) {
+        // power=ln^n/(n!*2^(n-1)), inner=sum of 1/(2k+1) for 2k+1<=n.
+        power*=ln/(2.0L*n);
+        if(n&1) {
+            inner+=1.0L/n;
+        }
+        long double term=power*inner;
+        sum+=(n&1)?term:-term;
+        if(n>ln&&term<1e-21L*std::fabs(sum)) {
+            break;
+        }
+    }
+    return kEulerGamma+std::log(ln)+std::sqrt(x)*sum;
+}
+
+int moebius(int n) {
+    int result=1;
+    for(int p=2;p*p<=n;++p) {
+        if(n%p==0) {
+            n/=p;
+            if(n%p==0) {
+                return 0;
+            }
+            result=-result;
+        }
+    }
+    return n>1?-result:result;
+}
+
+// Riemann's R(x)=sum mu(n)/n*li(x^(1/n)), an estimate of pi(x).
+long double riemann_r(long double x) {
+    if(x<2.0L) {
+        return 0.0L;
+    }
+    long double sum=0.0L;
+    for(int n=1;n<64;++n) {
+        long double root=std::pow(x,1.0L/n);
+        if(root<2.0L) {
+            break;
+        }
+        int mu=moebius(n);
+        if(mu!=0) {
+            sum+=mu*log_integral(root)/n;
+        }
+    }
+    return sum;
+}
+
+// The x>=lower with R(x)=target, by Newton's method with R'(x)~1/ln x.
+std::uint64_t inverse_riemann_r(long double target,std::uint64_t lower) {
+    constexpr long double kMax=18446744073709551615.0L;
+    long double x=std::max<long double>(lower,3.0L);
+    long double gap=target-riemann_r(x);
+    if(gap<=0.0L) {
+        return lower;
+    }
+    x+=gap*std::log(x+gap*std::log(x));
+    for(int i=0;i<64&&x<kMax;++i) {
+        long double step=(target-riemann_r(x))*std::log(x);
+        x=std::max<long double>(x+step,lower);
+        if(std::fabs(step)<0.5L) {
+            break;
+        }
+    }
+    return x>=kMax?std::numeric_limits<std::uint64_t>::max():static_cast<std::uint64_t>(x);
+}
+
+struct SegmentRecord {
+    std::uint64_t low;
+    std::uint64_t high;
+    std::uint64_t count;
+};
+
+// Per-segment prime counts of [begin,end) (both odd), each thread sieving
+// one contiguous block.
+std::vector<SegmentRecord>sieve_window(const Wheel&wheel,const SegmentConfig&config,std::uint64_t begin,std::uint64_t end,const BasePrimes&primes,unsigned threads) {
+    SieveRange range{begin,end};
+    SegmentWorkQueue queue(range,config,SegmentSchedule::Contiguous,threads);
+    PrimeMarker marker(wheel,config,begin,end,primes,wheel.small_prime_limit,threads);
+    std::vector<SegmentRecord>records(queue.segment_count());
+    auto work=[&](unsigned t) {
+        auto state=marker.make_thread_state(queue.first_segment(t));
+        std::vector<std::uint64_t>bitset;
+        SegmentCounts counts;
+        std::uint64_t segment_id=0;
+        std::uint64_t seg_low=0;
+        std::uint64_t seg_high=0;
+        while(queue.next(t,segment_id,seg_low,seg_high)) {
+            marker.sieve_segment(state,segment_id,seg_low,seg_high,bitset,&counts);
+            // With the mod-30 layout the first segment starts below begin.
+            records[static_cast<std::size_t>(segment_id)]=SegmentRecord{std::max(seg_low,begin),seg_high,counts.total};
+        }
+    };
+    std::vector<std::thread>pool;
+    for(unsigned t=1;t<threads;++t) {
+        pool.emplace_back(work,t);
+    }
+    work(0);
+    for(auto&thread : pool) {
+        thread.join();
+    }
+    return records;
+}
+
+// The index-th prime (from 1) of one segment, sieved on its own.
+std::uint64_t prime_in_segment(const Wheel&wheel,const SegmentConfig&config,const SegmentRecord&segment,std::uint64_t index,const BasePrimes&primes) {
+    SegmentWorkQueue queue(SieveRange{segment.low,segment.high},config);
+    PrimeMarker marker(wheel,config,segment.low,segment.high,primes,wheel.small_prime_limit,1);
+    auto state=marker.make_thread_state(0);
+    std::vector<std::uint64_t>bitset;
+    SegmentCounts counts;
+    std::uint64_t segment_id=0;
+    std::uint64_t seg_low=0;
+    std::uint64_t seg_high=0;
+    queue.next(0,segment_id,seg_low,seg_high);
+    marker.sieve_segment(state,segment_id,seg_low,seg_high,bitset,&counts);
+    std::vector<std::uint64_t>found(static_cast<std::size_t>(counts.total));
+    marker.extract_primes(bitset,seg_low,seg_high,found.data());
+    return found[static_cast<std::size_t>(index-1)];
+}
+
+}
+
+NthPrime find_nth_prime(std::uint64_t from,std::uint64_t to,std::uint64_t k,const Wheel&wheel,const SegmentConfig&config,CountMethod mode,HybridMode hybrid,const std::string&cache_path,unsigned threads) {
+    NthPrime result;
+    result.counted_to=from;
+    if(k==0||to<=from) {
+        return result;
+    }
+    if(threads==0) {
+        threads=effective_thread_count(detect_cpu_info());
+    }
+    threads=std::max(threads,1u);
+
+    if(from<kListLimit) {
+        for(std::uint32_t p : simple_sieve(kListLimit-1,1)) {
+            if(p>=from&&p<to&&--k==0) {
+                result.prime=p;
+                return result;
+            }
+        }
+        from=kListLimit;
+        result.counted_to=from;
+        if(to<=from) {
+            return result;
+        }
+    }
+    std::uint64_t begin=from|1ULL;
+    std::uint64_t end=(to&1ULL)?to:to+1;
+    if(begin>=end) {
+        return result;
+    }
+
+    std::uint64_t estimate=std::min(inverse_riemann_r(riemann_r(static_cast<long double>(begin))+k,begin),end-1);
+    // |pi(x)-R(x)| stays far below sqrt(x)/ln(x) in practice, which puts the
+    // prime within about sqrt(x) of the estimate.
+    std::uint64_t margin=2*integer_sqrt(estimate)+config.segment_span;
+
+    // Sieving primes reach a little past the estimate at first, and are
+    // reloaded should the search run beyond that.
+    BasePrimes primes;
+    std::uint64_t primes_cover=0;
+    auto ensure_primes=[&](std::uint64_t last) {
+        if(last<=primes_cover) {
+            return;
+        }
+        primes_cover=std::max(last,std::min(end-1,saturating_add(estimate,4*margin)));
+        primes=sieving_primes(cache_path,integer_sqrt(primes_cover)+1,threads,&result.cache_outcome);
+    };
+
+    std::uint64_t low=begin;
+    std::uint64_t remaining=k;
+    if(estimate-begin>margin) {
+        std::uint64_t bound=(estimate-margin)|1ULL;
+        if(choose_count_method(mode,begin,bound,config)==CountMethod::Analytic) {
+            ensure_primes(bound-1);
+            std::uint64_t below=deleglise_rivat_count(begin,bound,primes,threads);
+            // The estimate was high: step back and take the sieved primes
+            // between the old and new bound off the count.
+            std::uint64_t step=margin;
+            while(below>=remaining) {
+                step*=4;
+                std::uint64_t back=bound-begin>step?bound-step:begin;
+                for(const SegmentRecord&segment : sieve_window(wheel,config,back,bound,primes,threads)) {
+                    below-=segment.count;
+                }
+                bound=back;
+            }
+            remaining-=below;
+            low=bound;
+            result.counted_to=bound;
+            result.count_method=CountMethod::Analytic;
+        }
+    }
+
+    // From a counted bound the prime lies within a margin or two. From the
+    // start of the range the windows just run on, so the first one only
+    // reaches a little past the estimate.
+    std::uint64_t length=2*margin;
+    if(low==begin) {
+        length=saturating_add(estimate-begin+(estimate-begin)/8,config.segment_span);
+        // A tiny window high up: sieve with small primes only and let the
+        // marker confirm the candidates, for every window that follows too.
+        std::uint64_t cover=std::min(end,saturating_add(begin,length))|1ULL;
+        std::uint64_t bound=hybrid_sieve_bound(hybrid,config,begin,cover,!cache_path.empty());
+        if(bound) {
+            primes=sieving_primes(cache_path,bound,threads,&result.cache_outcome);
+            primes_cover=std::numeric_limits<std::uint64_t>::max();
+            result.hybrid_bound=bound;
+        }
+    }
+    std::uint64_t max_length=static_cast<std::uint64_t>(config.segment_span)*kMaxWindowSegments;
+    while(low<end) {
+        std::uint64_t high=std::min(end,saturating_add(low,std::min(length,max_length)))|1ULL;
+        ensure_primes(high-1);
+        std::vector<SegmentRecord>segments=sieve_window(wheel,config,low,high,primes,threads);
+        for(const SegmentRecord&segment : segments) {
+            if(segment.count>=remaining) {
+                result.prime=prime_in_segment(wheel,config,segment,remaining,primes);
+                return result;
+            }
+            remaining-=segment.count;
+        }
+        low=high;
+        length=saturating_add(length,length);
+    }
+    return result;
+}
+
+}
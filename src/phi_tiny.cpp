@@ -0,0 +1,57 @@
+#include "phi_tiny.h"
+
+#include "divider.h"
+
+#include <array>
+#include <vector>
+
+namespace calcprime {
+namespace {
+
+constexpr std::array<std::uint32_t,kPhiTinyMaxA>kTinyPrimes{2,3,5,7,11,13};
+
+struct PhiTinyTables {
+    std::array<std::uint32_t,kPhiTinyMaxA+1>period{};
+    std::array<std::uint32_t,kPhiTinyMaxA+1>totient{};
+    std::array<FastDivider,kPhiTinyMaxA+1>divider{};
+    // phi(r,a) for 0<=r<period[a].
+    std::array<std::vector<std::uint16_t>,kPhiTinyMaxA+1>residues;
+
+    PhiTinyTables() {
+        period[0]=1;
+        totient[0]=1;
+        for(unsigned a=1;a<=kPhiTinyMaxA;++a) {
+            period[a]=period[a-1]*kTinyPrimes[a-1];
+            totient[a]=totient[a-1]*(kTinyPrimes[a-1]-1);
+        }
+        for(unsigned a=0;a<=kPhiTinyMaxA;++a) {
+            divider[a]=FastDivider(period[a]);
+            residues[a].resize(period[a]);
+            std::uint16_t count=0;
+            for(std::uint32_t r=0;r<period[a];++r) {
+                bool coprime=r!=0;
+                for(unsigned i=0;i<a&&coprime;++i) {
+                    coprime=r%kTinyPrimes[i]!=0;
+                }
+                count=static_cast<std::uint16_t>(count+(coprime?1:0));
+                residues[a][r]=count;
+            }
+        }
+    }
+};
+
+const PhiTinyTables&phi_tiny_tables() {
+    static const PhiTinyTables tables;
+    return tables;
+}
+
+}
+
+std::uint64_t phi_tiny(std::uint64_t x,unsigned a) {
+    const PhiTinyTables&tables=phi_tiny_tables();
+    std::uint64_t q=tables.divider[a].divide(x);
+    std::uint64_t r=x-q*tables.period[a];
+    return q*tables.totient[a]+tables.residues[a][static_cast<std::size_t>(r)];
+}
+
+}
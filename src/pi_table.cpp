@@ -0,0 +1,117 @@
+#include "pi_table.h"
+
+#include "cpu_info.h"
+#include "marker.h"
+#include "segmenter.h"
+#include "wheel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace calcprime {
+
+PiTable::PiTable(const BasePrimes&primes,std::uint64_t limit)
+    : limit_(limit),bits_(static_cast<std::size_t>(limit/128+1),0),counts_(bits_.size(),0) {
+    BasePrimes::Reader it=primes.reader();
+    for(std::size_t i=0;i<primes.size();++i) {
+        std::uint64_t p=it.next();
+        if(p>limit) {
+            break;
+        }
+        bits_[static_cast<std::size_t>(p>>7)]|=1ULL<<((p&127)>>1);
+    }
+    fill_counts();
+}
+
+PiTable PiTable::sieve(std::uint64_t limit,unsigned threads) {
+    PiTable table;
+    table.limit_=limit;
+    table.bits_.assign(static_cast<std::size_t>(limit/128+2),0);
+    table.counts_.assign(table.bits_.size(),0);
+    if(limit<3) {
+        table.fill_counts();
+        return table;
+    }
+    threads=std::max(threads,1u);
+    std::uint64_t begin=3;
+    std::uint64_t end=limit+1;
+    if((end&1ULL)==0) {
+        ++end;
+    }
+    std::uint64_t sqrt_limit=static_cast<std::uint64_t>(std::sqrt(static_cast<long double>(limit)))+1;
+    BasePrimes primes=generate_base_primes(sqrt_limit,threads);
+    CpuInfo info=detect_cpu_info();
+    SegmentConfig config=choose_segment_config(info,threads,0,0,end-begin,SieveLayout::OddBits);
+    SieveRange range{begin,end};
+    SegmentWorkQueue queue(range,config,SegmentSchedule::Contiguous,threads);
+    const Wheel&wheel=get_wheel(WheelType::Mod30);
+    PrimeMarker marker(wheel,config,begin,end,primes,wheel.small_prime_limit,threads);
+
+    // Sieve bit i of a segment is the odd number low+2i, table bit
+    // (low-1)/2+i. Segments hold whole words (segment_bits is a multiple of
+    // 1024), so the table words of a segment are shifted up by one bit and
+    // each segment's top bit, carried into the next segment's first word,
+    // is added once all threads are done.
+    std::vector<std::uint8_t>carries(queue.segment_count(),0);
+    auto work=[&](unsigned t) {
+        auto state=marker.make_thread_state(queue.first_segment(t));
+        std::vector<std::uint64_t>bitset;
+        std::uint64_t segment_id=0;
+        std::uint64_t low=0;
+        std::uint64_t high=0;
+        while(queue.next(t,segment_id,low,high)) {
+            marker.sieve_segment(state,segment_id,low,high,bitset);
+            std::size_t bit_count=marker.segment_bits(low,high);
+            std::size_t first_word=static_cast<std::size_t>((low-begin)/128);
+            std::uint64_t carry=0;
+            for(std::size_t j=0;j*64<bit_count;++j) {
+                std::uint64_t primes_mask=~bitset[j];
+                if(bit_count-j*64<64) {
+                    primes_mask&=~0ULL>>(64-(bit_count-j*64));
+                }
+                table.bits_[first_word+j]=primes_mask<<1|carry;
+                carry=primes_mask>>63;
+            }
+            carries[static_cast<std::size_t>(segment_id)]=static_cast<std::uint8_t>(carry);
+        }
+    };
+    std::vector<std::thread>pool;
+    for(unsigned t=1;t<threads;++t) {
+        pool.emplace_back(work,t);
+    }
+    work(0u);
+    for(auto&thread : pool) {
+        thread.join();
+    }
+    for(std::size_t id=0;id+1<carries.size();++id) {
+        table.bits_[static_cast<std::size_t>((id+1)*config.segment_bits/64)]|=carries[id];
+    }
+    // The presieved primes never show up in a segment.
+    for(std::uint32_t p : wheel.presieve_primes) {
+        if(p>2&&p<=limit) {
+            table.bits_[p>>7]|=1ULL<<((p&127)>>1);
+        }
+    }
+    // Bits past limit stay out of the counts.
+    std::uint64_t last=limit|1ULL;
+    if(last>limit) {
+        last-=2;
+    }
+    std::size_t word=static_cast<std::size_t>(last>>7);
+    unsigned bit=static_cast<unsigned>((last&127)>>1);
+    table.bits_[word]&=bit==63?~0ULL:(1ULL<<(bit+1))-1;
+    std::fill(table.bits_.begin()+static_cast<std::ptrdiff_t>(word)+1,table.bits_.end(),0);
+    table.fill_counts();
+    return table;
+}
+
+void PiTable::fill_counts() {
+    std::uint32_t count=0;
+    for(std::size_t w=0;w<bits_.size();++w) {
+        counts_[w]=count;
+        count+=static_cast<std::uint32_t>(std::popcount(bits_[w]));
+    }
+}
+
+}
@@ -0,0 +1,331 @@
+#include "prime_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace calcprime {
+namespace {
+
+constexpr char kCacheMagic[8]={'C','P','R','I','M','E','S','\0'};
+constexpr std::uint32_t kCacheVersion=1;
+// Written in native order; a file from a machine of the other byte order
+// fails this check and is rebuilt.
+constexpr std::uint32_t kByteOrderMark=0x01020304u;
+constexpr std::uint64_t kMaxCacheLimit=0xFFFFFFFFULL;
+// Smallest bound written, so tiny jobs do not leave a cache every larger
+// job has to rebuild.
+constexpr std::uint64_t kMinCacheLimit=1ULL<<20;
+
+// File layout: header, chunk table, then every chunk's half-gaps back to
+// back. The header checksum covers the chunk table and each chunk carries
+// the checksum of its own gaps, so a load verifies only what it uses.
+struct CacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t limit;
+    std::uint64_t prime_count;
+    std::uint64_t chunk_count;
+    std::uint64_t gap_bytes;
+    std::uint64_t table_checksum;
+};
+
+struct CacheChunk {
+    std::uint64_t gap_offset;
+    std::uint64_t gap_count;
+    std::uint64_t checksum;
+    std::uint32_t first_prime;
+    std::uint32_t reserved;
+};
+
+static_assert(sizeof(CacheHeader)==56,"cache header layout");
+static_assert(sizeof(CacheChunk)==32,"cache chunk layout");
+
+std::uint64_t checksum_bytes(const void*data,std::size_t size) {
+    const unsigned char*bytes=static_cast<const unsigned char*>(data);
+    std::uint64_t hash=0xcbf29ce484222325ULL^size;
+    for(;size>=8;size-=8,bytes+=8) {
+        std::uint64_t word;
+        std::memcpy(&word,bytes,8);
+        hash=(hash^word)*0x100000001b3ULL;
+        hash^=hash>>29;
+    }
+    for(;size>0;--size,++bytes) {
+        hash=(hash^*bytes)*0x100000001b3ULL;
+    }
+    return hash;
+}
+
+class MappedFile {
+public:
+    MappedFile()=default;
+    MappedFile(const MappedFile&)=delete;
+    MappedFile&operator=(const MappedFile&)=delete;
+    ~MappedFile() {
+#ifdef _WIN32
+        if(data_) {
+            UnmapViewOfFile(data_);
+        }
+        if(mapping_) {
+            CloseHandle(mapping_);
+        }
+        if(file_!=INVALID_HANDLE_VALUE) {
+            CloseHandle(file_);
+        }
+#else
+        if(data_) {
+            munmap(const_cast<unsigned char*>(data_),size_);
+        }
+#endif
+    }
+
+    bool open(const std::string&path) {
+#ifdef _WIN32
+        file_=CreateFileA(path.c_str(),GENERIC_READ,FILE_SHARE_READ|FILE_SHARE_DELETE,nullptr,OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL,nullptr);
+        if(file_==INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(file_,&size)||size.QuadPart<=0) {
+            return false;
+        }
+        size_=static_cast<std::size_t>(size.QuadPart);
+        mapping_=CreateFileMappingA(file_,nullptr,PAGE_READONLY,0,0,nullptr);
+        if(!mapping_) {
+            return false;
+        }
+        data_=static_cast<const unsigned char*>(MapViewOfFile(mapping_,FILE_MAP_READ,0,0,0));
+        return data_!=nullptr;
+#else
+        int fd=::open(path.c_str(),O_RDONLY);
+        if(fd<0) {
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd,&st)!=0||st.st_size<=0) {
+            ::close(fd);
+            return false;
+        }
+        size_=static_cast<std::size_t>(st.st_size);
+        void*data=mmap(nullptr,size_,PROT_READ,MAP_SHARED,fd,0);
+        ::close(fd);
+        if(data==MAP_FAILED) {
+            return false;
+        }
+        data_=static_cast<const unsigned char*>(data);
+        return true;
+#endif
+    }
+
+    const unsigned char*data() const { return data_;}
+    std::size_t size() const { return size_;}
+
+private:
+    const unsigned char*data_=nullptr;
+    std::size_t size_=0;
+#ifdef _WIN32
+    HANDLE file_=INVALID_HANDLE_VALUE;
+    HANDLE mapping_=nullptr;
+#endif
+};
+
+// The bound stored in a well-formed cache file, or 0.
+std::uint64_t mapped_limit(const MappedFile&file,const CacheHeader*&header,const CacheChunk*&table) {
+    if(file.size()<sizeof(CacheHeader)) {
+        return 0;
+    }
+    header=reinterpret_cast<const CacheHeader*>(file.data());
+    if(std::memcmp(header->magic,kCacheMagic,sizeof(kCacheMagic))!=0||header->version!=kCacheVersion||
+       header->byte_order!=kByteOrderMark||header->limit>kMaxCacheLimit) {
+        return 0;
+    }
+    std::uint64_t available=file.size()-sizeof(CacheHeader);
+    if(header->chunk_count>available/sizeof(CacheChunk)||
+       header->gap_bytes!=available-header->chunk_count*sizeof(CacheChunk)) {
+        return 0;
+    }
+    table=reinterpret_cast<const CacheChunk*>(file.data()+sizeof(CacheHeader));
+    std::size_t table_bytes=static_cast<std::size_t>(header->chunk_count*sizeof(CacheChunk));
+    if(checksum_bytes(table,table_bytes)!=header->table_checksum) {
+        return 0;
+    }
+    return header->limit;
+}
+
+BasePrimes map_cache(std::shared_ptr<MappedFile>file,const CacheHeader&header,const CacheChunk*table,
+                     std::uint64_t limit,bool&ok) {
+    ok=false;
+    const unsigned char*gaps=file->data()+sizeof(CacheHeader)+header.chunk_count*sizeof(CacheChunk);
+    std::vector<BasePrimes::Chunk>chunks;
+    std::uint32_t previous_prime=0;
+    for(std::uint64_t c=0;c<header.chunk_count;++c) {
+        const CacheChunk&entry=table[c];
+        if(entry.first_prime<=previous_prime||entry.gap_offset>header.gap_bytes||
+           entry.gap_count>header.gap_bytes-entry.gap_offset) {
+            return BasePrimes();
+        }
+        previous_prime=entry.first_prime;
+        if(entry.first_prime>limit) {
+            break;
+        }
+        const std::uint8_t*chunk_gaps=gaps+entry.gap_offset;
+        std::size_t gap_count=static_cast<std::size_t>(entry.gap_count);
+        if(checksum_bytes(chunk_gaps,gap_count)!=entry.checksum) {
+            return BasePrimes();
+        }
+        BasePrimes::Chunk chunk;
+        chunk.first_prime=entry.first_prime;
+        chunk.half_gaps=chunk_gaps;
+        chunk.gap_count=gap_count;
+        chunks.push_back(chunk);
+    }
+    ok=true;
+    return BasePrimes(header.limit,std::move(chunks),std::move(file)).prefix(limit);
+}
+
+std::uint64_t current_process_id() {
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return static_cast<std::uint64_t>(getpid());
+#endif
+}
+
+bool write_cache(const std::string&path,const BasePrimes&primes) {
+    const std::vector<BasePrimes::Chunk>&chunks=primes.chunks();
+    std::vector<CacheChunk>table(chunks.size());
+    std::uint64_t gap_bytes=0;
+    for(std::size_t c=0;c<chunks.size();++c) {
+        table[c].gap_offset=gap_bytes;
+        table[c].gap_count=chunks[c].gap_count;
+        table[c].checksum=checksum_bytes(chunks[c].half_gaps,chunks[c].gap_count);
+        table[c].first_prime=chunks[c].first_prime;
+        table[c].reserved=0;
+        gap_bytes+=chunks[c].gap_count;
+    }
+    CacheHeader header;
+    std::memcpy(header.magic,kCacheMagic,sizeof(kCacheMagic));
+    header.version=kCacheVersion;
+    header.byte_order=kByteOrderMark;
+    header.limit=primes.limit();
+    header.prime_count=primes.size();
+    header.chunk_count=table.size();
+    header.gap_bytes=gap_bytes;
+    header.table_checksum=checksum_bytes(table.data(),table.size()*sizeof(CacheChunk));
+
+    // Unique per process and call, so concurrent writers never share a
+    // temporary; the last rename wins and every version is complete.
+    static std::atomic<unsigned>sequence{0};
+    std::string temp_path=path+".tmp."+std::to_string(current_process_id())+"."+
+                          std::to_string(sequence.fetch_add(1));
+    std::FILE*file=std::fopen(temp_path.c_str(),"wb");
+    if(!file) {
+        return false;
+    }
+    bool ok=std::fwrite(&header,sizeof(header),1,file)==1;
+    if(ok&&!table.empty()) {
+        ok=std::fwrite(table.data(),sizeof(CacheChunk),table.size(),file)==table.size();
+    }
+    for(std::size_t c=0;ok&&c<chunks.size();++c) {
+        if(chunks[c].gap_count!=0) {
+            ok=std::fwrite(chunks[c].half_gaps,1,chunks[c].gap_count,file)==chunks[c].gap_count;
+        }
+    }
+    ok=(std::fclose(file)==0)&&ok;
+    std::error_code ec;
+    if(ok) {
+        std::filesystem::rename(temp_path,path,ec);
+        ok=!ec;
+    }
+    if(!ok) {
+        std::filesystem::remove(temp_path,ec);
+    }
+    return ok;
+}
+
+}
+
+BasePrimes load_base_primes(const std::string&path,std::uint64_t limit,unsigned threads,
+                            PrimeCacheOutcome*outcome) {
+    limit=std::min(limit,kMaxCacheLimit);
+    std::uint64_t stored_limit=0;
+    {
+        auto file=std::make_shared<MappedFile>();
+        const CacheHeader*header=nullptr;
+        const CacheChunk*table=nullptr;
+        if(file->open(path)) {
+            stored_limit=mapped_limit(*file,header,table);
+        }
+        if(stored_limit!=0&&stored_limit>=limit) {
+            bool ok=false;
+            BasePrimes primes=map_cache(file,*header,table,limit,ok);
+            if(ok) {
+                if(outcome) {
+                    *outcome=PrimeCacheOutcome::Mapped;
+                }
+                return primes;
+            }
+            stored_limit=0;
+        }
+    }
+
+    // Grow geometrically, so a series of slowly rising bounds rebuilds the
+    // file a logarithmic number of times.
+    std::uint64_t build_limit=std::max({limit,kMinCacheLimit,std::min(2*stored_limit,kMaxCacheLimit)});
+    BasePrimes primes=generate_base_primes(build_limit,threads);
+    bool written=write_cache(path,primes);
+    if(outcome) {
+        *outcome=written?PrimeCacheOutcome::Written:PrimeCacheOutcome::WriteFailed;
+    }
+    return primes.prefix(limit);
+}
+
+BasePrimes sieving_primes(const std::string&cache_path,std::uint64_t limit,unsigned threads,
+                          PrimeCacheOutcome*outcome) {
+    if(cache_path.empty()) {
+        if(outcome) {
+            *outcome=PrimeCacheOutcome::Disabled;
+        }
+        return generate_base_primes(limit,threads);
+    }
+    return load_base_primes(cache_path,limit,threads,outcome);
+}
+
+std::string prime_cache_path_from_env() {
+    const char*env=std::getenv("CALCPRIME_PRIME_CACHE");
+    return env?std::string(env):std::string();
+}
+
+const char*prime_cache_outcome_name(PrimeCacheOutcome outcome) {
+    switch(outcome) {
+    case PrimeCacheOutcome::Disabled:
+        return "off";
+    case PrimeCacheOutcome::Mapped:
+        return "mapped";
+    case PrimeCacheOutcome::Written:
+        return "written";
+    case PrimeCacheOutcome::WriteFailed:
+        return "write failed";
+    }
+    return "unknown";
+}
+
+}
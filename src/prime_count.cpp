@@ -1,7 +1,14 @@
 #include "prime_count.h"
 
+#include "divider.h"
+#include "kernels.h"
+#include "phi_tiny.h"
+#include "pi_table.h"
+
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cmath>
 #include <future>
 #include <map>
@@ -81,21 +88,99 @@ std::uint64_t integer_fourth_root(std::uint64_t n) {
     return root;
 }
 
+// 2^30 numbers in the pi table, 96 MiB.
+constexpr std::uint64_t kMeisselTableLimit=std::uint64_t{1}<<30;
+
+// phi(x,a) values of one thread in a flat open-addressing table. It doubles
+// up to kPhiCacheMaxSlots and then keeps what it holds instead of evicting,
+// so memory stays bounded however deep the recursion goes.
+class PhiCache {
+public:
+    bool find(std::uint64_t x,std::uint32_t a,std::uint64_t&value) const {
+        if(slots_.empty()) {
+            return false;
+        }
+        for(std::size_t i=slot_index(x,a);;i=(i+1)&mask_) {
+            const Slot&slot=slots_[i];
+            if(slot.a==0) {
+                return false;
+            }
+            if(slot.x==x&&slot.a==a) {
+                value=slot.value;
+                return true;
+            }
+        }
+    }
+
+    // a>0; a is the empty-slot marker.
+    void insert(std::uint64_t x,std::uint32_t a,std::uint64_t value) {
+        if((used_+1)*4>slots_.size()*3) {
+            if(slots_.size()>=kPhiCacheMaxSlots) {
+                return;
+            }
+            grow();
+        }
+        std::size_t i=slot_index(x,a);
+        while(slots_[i].a!=0) {
+            if(slots_[i].x==x&&slots_[i].a==a) {
+                return;
+            }
+            i=(i+1)&mask_;
+        }
+        slots_[i]=Slot{x,value,a};
+        ++used_;
+    }
+
+private:
+    static constexpr std::size_t kPhiCacheMinSlots=std::size_t{1}<<12;
+    // 2^19 slots of 24 bytes, 12 MiB per thread.
+    static constexpr std::size_t kPhiCacheMaxSlots=std::size_t{1}<<19;
+
+    struct Slot {
+        std::uint64_t x=0;
+        std::uint64_t value=0;
+        std::uint32_t a=0;
+    };
+
+    std::size_t slot_index(std::uint64_t x,std::uint32_t a) const {
+        std::uint64_t h=(x^(static_cast<std::uint64_t>(a)<<48))*0x9E3779B97F4A7C15ULL;
+        return static_cast<std::size_t>(h>>32^h)&mask_;
+    }
+
+    void grow() {
+        std::vector<Slot>old=std::move(slots_);
+        slots_.assign(old.empty()?kPhiCacheMinSlots:old.size()*2,Slot{});
+        mask_=slots_.size()-1;
+        used_=0;
+        for(const Slot&slot : old) {
+            if(slot.a!=0) {
+                insert(slot.x,slot.a,slot.value);
+            }
+        }
+    }
+
+    std::vector<Slot>slots_;
+    std::size_t mask_=0;
+    std::size_t used_=0;
+};
+
+// pi(w) of every argument up to the table limit is a lookup; only those
+// above it, from the few primes p_i below x^(1/3) once the table is capped,
+// recurse into a full evaluation.
 class MeisselCalculator {
 public:
-    explicit MeisselCalculator(const std::vector<std::uint32_t>&primes)
-        : primes_(primes),max_prime_(primes.empty() ? 0 : primes.back()) {}
+    MeisselCalculator(const std::vector<std::uint32_t>&primes,PiTable pi_table)
+        : primes_(primes),pi_table_(std::move(pi_table)) {}
 
-    std::uint64_t pi(std::uint64_t n,unsigned threads=1) {
+    std::uint64_t pi(std::uint64_t n,unsigned threads,PhiCache&cache) {
         if(n<2) {
             return 0;
         }
         if(primes_.empty()) {
             return small_pi(n);
         }
-        if(n<=max_prime_) {
-            auto it=std::upper_bound(primes_.begin(),primes_.end(),static_cast<std::uint32_t>(n));
-            return static_cast<std::uint64_t>(std::distance(primes_.begin(),it));
+        if(n<=pi_table_.limit()) {
+            return pi_table_[n];
         }
         {
             std::lock_guard<std::mutex>lock(pi_mutex_);
@@ -105,11 +190,11 @@ public:
             }
         }
 
-        std::uint64_t a=pi(integer_fourth_root(n),1);
-        std::uint64_t b=pi(integer_sqrt(n),1);
-        std::uint64_t c=pi(integer_cuberoot(n),1);
+        std::uint64_t a=pi(integer_fourth_root(n),1,cache);
+        std::uint64_t b=pi(integer_sqrt(n),1,cache);
+        std::uint64_t c=pi(integer_cuberoot(n),1,cache);
 
-        std::uint64_t result=phi(n,static_cast<std::size_t>(a));
+        std::uint64_t result=phi_parallel(n,static_cast<std::size_t>(a),threads,cache);
         if(b+a>=2) {
             std::uint64_t left=b+a-2;
             std::uint64_t right=b-a+1;
@@ -122,7 +207,7 @@ public:
             iteration_count=effective_b-a;
         }
 
-        auto compute_range=[this,n,c](std::uint64_t start,std::uint64_t end) {
+        auto compute_range=[this,n,c](std::uint64_t start,std::uint64_t end,PhiCache&local_cache) {
             std::uint64_t subtotal=0;
             for(std::uint64_t i=start;i<end;++i) {
                 std::uint64_t index=i-1;
@@ -131,16 +216,16 @@ public:
                 }
                 std::uint64_t p=primes_[static_cast<std::size_t>(index)];
                 std::uint64_t w=n/p;
-                subtotal+=this->pi(w,1);
+                subtotal+=this->pi(w,1,local_cache);
                 if(i<=c) {
-                    std::uint64_t limit=this->pi(integer_sqrt(w),1);
+                    std::uint64_t limit=this->pi(integer_sqrt(w),1,local_cache);
                     for(std::uint64_t j=i;j<=limit;++j) {
                         std::uint64_t j_index=j-1;
                         if(j_index>=primes_.size()) {
                             break;
                         }
                         std::uint64_t pj=primes_[static_cast<std::size_t>(j_index)];
-                        subtotal+=this->pi(w/pj,1)-(j-1);
+                        subtotal+=this->pi(w/pj,1,local_cache)-(j-1);
                     }
                 }
             }
@@ -149,7 +234,7 @@ public:
 
         if(iteration_count>0) {
             if(threads<=1||iteration_count==1) {
-                result-=compute_range(a+1,effective_b+1);
+                result-=compute_range(a+1,effective_b+1,cache);
             } else {
                 unsigned worker_count=std::min<std::uint64_t>(threads,iteration_count);
                 if(worker_count==0) {
@@ -170,7 +255,8 @@ public:
                     current=chunk_end;
                     futures.emplace_back(std::async(std::launch::async,
                                                     [compute_range,chunk_start,chunk_end]() {
-                                                        return compute_range(chunk_start,chunk_end);
+                                                        PhiCache local_cache;
+                                                        return compute_range(chunk_start,chunk_end,local_cache);
                                                     }));
                 }
                 std::uint64_t subtract_total=0;
@@ -192,34 +278,72 @@ public:
     }
 
 private:
-    std::uint64_t phi(std::uint64_t x,std::size_t s) {
-        if(s==0) {
-            return x;
+    // phi(x,a) expanded as phi(x,c)-sum of phi(x/p_i,i-1) for c<i<=a, with
+    // phi(.,c) read from the periodic tables. The expansion stops early:
+    // phi(x,a)=1 once x<p_(a+1), and pi(x)-a+1 once x<p_(a+1)^2.
+    std::uint64_t phi(std::uint64_t x,std::size_t a,PhiCache&cache) {
+        a=std::min(a,primes_.size());
+        if(a<=kPhiTinyMaxA) {
+            return phi_tiny(x,static_cast<unsigned>(a));
         }
-        if(s==1) {
-            return (x+1)>>1;
+        if(a<primes_.size()) {
+            std::uint64_t next=primes_[a];
+            if(x<next) {
+                return x==0?0:1;
+            }
+            if(x<=pi_table_.limit()&&x/next<next) {
+                return pi_table_[x]-a+1;
+            }
         }
-        if(s>primes_.size()) {
-            return phi(x,primes_.size());
+        std::uint64_t result=0;
+        if(cache.find(x,static_cast<std::uint32_t>(a),result)) {
+            return result;
         }
-        auto key=std::make_pair(x,s);
-        {
-            std::lock_guard<std::mutex>lock(phi_mutex_);
-            auto cached=phi_cache_.find(key);
-            if(cached!=phi_cache_.end()) {
-                return cached->second;
+        result=phi_tiny(x,kPhiTinyMaxA);
+        for(std::size_t i=kPhiTinyMaxA+1;i<=a;++i) {
+            std::uint64_t p=primes_[i-1];
+            std::uint64_t xp=x/p;
+            if(xp<p) {
+                // phi(x/p_j,j-1)=1 for every remaining j.
+                result-=a-i+1;
+                break;
             }
+            result-=phi(xp,i-1,cache);
         }
-        std::uint64_t result=phi(x,s-1);
-        std::uint32_t p=primes_[s-1];
-        result-=phi(x/p,s-1);
-        {
-            std::lock_guard<std::mutex>lock(phi_mutex_);
-            phi_cache_.emplace(key,result);
-        }
+        cache.insert(x,static_cast<std::uint32_t>(a),result);
         return result;
     }
 
+    // The top-level phi(n,a) with its terms shared out to threads, each
+    // filling a cache of its own.
+    std::uint64_t phi_parallel(std::uint64_t x,std::size_t a,unsigned threads,PhiCache&cache) {
+        a=std::min(a,primes_.size());
+        if(threads<=1||a<=kPhiTinyMaxA+1) {
+            return phi(x,a,cache);
+        }
+        std::atomic<std::size_t>next_i{kPhiTinyMaxA+1};
+        auto work=[this,x,a,&next_i](PhiCache&local_cache) {
+            std::uint64_t subtotal=0;
+            for(std::size_t i=next_i.fetch_add(1);i<=a;i=next_i.fetch_add(1)) {
+                subtotal+=phi(x/primes_[i-1],i-1,local_cache);
+            }
+            return subtotal;
+        };
+        unsigned worker_count=static_cast<unsigned>(std::min<std::size_t>(threads,a-kPhiTinyMaxA));
+        std::vector<std::future<std::uint64_t>>futures;
+        for(unsigned w=1;w<worker_count;++w) {
+            futures.emplace_back(std::async(std::launch::async,[work]() mutable {
+                PhiCache local_cache;
+                return work(local_cache);
+            }));
+        }
+        std::uint64_t subtract_total=work(cache);
+        for(auto&fut : futures) {
+            subtract_total+=fut.get();
+        }
+        return phi_tiny(x,kPhiTinyMaxA)-subtract_total;
+    }
+
     static std::uint64_t small_pi(std::uint64_t n) {
         static constexpr std::array<std::uint32_t,12>small_primes{
             2,3,5,7,11,13,17,19,23,29,31,37};
@@ -228,10 +352,8 @@ private:
     }
 
     const std::vector<std::uint32_t>&primes_;
-    std::uint64_t max_prime_;
-    std::map<std::pair<std::uint64_t,std::size_t>,std::uint64_t>phi_cache_;
+    PiTable pi_table_;
     std::map<std::uint64_t,std::uint64_t>pi_cache_;
-    mutable std::mutex phi_mutex_;
     mutable std::mutex pi_mutex_;
 };
 
@@ -266,82 +388,296 @@ std::uint64_t meissel_count(std::uint64_t from,std::uint64_t to,const std::vecto
     if(effective_threads==0) {
         effective_threads=1;
     }
-    MeisselCalculator calc(primes);
-    std::uint64_t upper=calc.pi(to-1,effective_threads);
-    std::uint64_t lower=from==0?0:calc.pi(from-1,effective_threads);
+    // Arguments of pi() stay below n^(3/4); past the cap they recurse.
+    std::uint64_t n=to-1;
+    std::uint64_t table_limit=std::min(integer_sqrt(n)*integer_fourth_root(n),kMeisselTableLimit);
+    MeisselCalculator calc(primes,PiTable::sieve(table_limit,effective_threads));
+    PhiCache cache;
+    std::uint64_t upper=calc.pi(to-1,effective_threads,cache);
+    std::uint64_t lower=from==0?0:calc.pi(from-1,effective_threads,cache);
     return upper>=lower?upper-lower:0;
 }
 
 namespace {
-std::uint64_t mul_mod(std::uint64_t a,std::uint64_t b,std::uint64_t mod) {
-    std::uint64_t result=0;
-    while(b>0) {
-        if(b&1ULL) {
-            result=(result+a)%mod;
+
+// Arithmetic modulo an odd n in Montgomery form, R=2^64. The reduction
+// subtracts the high words instead of adding, so every modulus below 2^64
+// works without a carry bit.
+struct Montgomery {
+    std::uint64_t n;
+    std::uint64_t n_inv;
+    std::uint64_t one;
+    std::uint64_t r2;
+
+    explicit Montgomery(std::uint64_t modulus) : n(modulus) {
+        // Newton's iteration doubles the correct low bits of n^-1 mod 2^64;
+        // n itself is right to 3 bits.
+        std::uint64_t inv=n;
+        for(int i=0;i<5;++i) {
+            inv*=2-n*inv;
+        }
+        n_inv=inv;
+        one=(0-n)%n;
+        r2=one;
+        for(int i=0;i<64;++i) {
+            r2=r2>=n-r2?r2-(n-r2):r2+r2;
         }
-        a=(a<<1U)%mod;
-        b>>=1U;
     }
-    return result;
-}
 
-std::uint64_t mod_pow(std::uint64_t base,std::uint64_t exp,std::uint64_t mod) {
-    std::uint64_t result=1%mod;
-    std::uint64_t b=base%mod;
-    while(exp>0) {
-        if(exp&1ULL) {
-            result=mul_mod(result,b,mod);
+    std::uint64_t reduce(std::uint64_t high,std::uint64_t low) const {
+        std::uint64_t m=low*n_inv;
+        std::uint64_t t=mul_high_u64(m,n);
+        return high>=t?high-t:high-t+n;
+    }
+
+    std::uint64_t mul(std::uint64_t a,std::uint64_t b) const {
+        return reduce(mul_high_u64(a,b),a*b);
+    }
+
+    std::uint64_t to_form(std::uint64_t a) const {
+        return mul(a%n,r2);
+    }
+};
+
+// Odd primes below 128 as a bitmask over n/2, so small n need no arithmetic.
+constexpr std::uint64_t kSmallPrimeMask=[] {
+    std::uint64_t mask=0;
+    for(std::uint64_t v=3;v<128;v+=2) {
+        bool prime=true;
+        for(std::uint64_t d=3;d*d<=v;d+=2) {
+            if(v%d==0) {
+                prime=false;
+            }
+        }
+        if(prime) {
+            mask|=1ULL<<(v/2);
+        }
+    }
+    return mask;
+}();
+
+// Odd primes for trial division, with inverses mod 2^64 and the largest
+// quotient: n is divisible by p exactly when n*inverse<=n_max/p.
+struct TrialDivisor {
+    std::uint64_t inverse;
+    std::uint64_t max_quotient;
+};
+
+constexpr std::array<std::uint32_t,14>kTrialPrimes{3,5,7,11,13,17,19,23,29,31,37,41,43,47};
+
+constexpr std::array<TrialDivisor,kTrialPrimes.size()>kTrialDivisors=[] {
+    std::array<TrialDivisor,kTrialPrimes.size()>table{};
+    for(std::size_t i=0;i<kTrialPrimes.size();++i) {
+        std::uint64_t p=kTrialPrimes[i];
+        std::uint64_t inv=p;
+        for(int k=0;k<5;++k) {
+            inv*=2-p*inv;
         }
-        b=mul_mod(b,b,mod);
-        exp>>=1ULL;
+        table[i]=TrialDivisor{inv,~0ULL/p};
     }
-    return static_cast<std::uint64_t>(result);
+    return table;
+}();
+
+// Deterministic bases: {2,7,61} for n<2^32 (Jaeschke) and the seven
+// bases of Jim Sinclair for every n<2^64.
+constexpr std::array<std::uint64_t,3>kBases32{2,7,61};
+constexpr std::array<std::uint64_t,7>kBases64{2,325,9375,28178,450775,9780504,1795265022};
+
+enum class TrialVerdict {
+    Composite,
+    Prime,
+    Undecided,
+};
+
+TrialVerdict trial_division(std::uint64_t n) {
+    if(n<128) {
+        return n==2||((n&1ULL)&&((kSmallPrimeMask>>(n/2))&1ULL))?TrialVerdict::Prime:TrialVerdict::Composite;
+    }
+    if((n&1ULL)==0) {
+        return TrialVerdict::Composite;
+    }
+    for(const TrialDivisor&divisor : kTrialDivisors) {
+        if(n*divisor.inverse<=divisor.max_quotient) {
+            return TrialVerdict::Composite;
+        }
+    }
+    // No factor below 53, so n<53^2 is prime.
+    return n<2809?TrialVerdict::Prime:TrialVerdict::Undecided;
 }
 
-bool check_composite(std::uint64_t n,std::uint64_t a,std::uint64_t d,unsigned r) {
-    std::uint64_t x=mod_pow(a,d,n);
-    if(x==1||x==n-1) {
-        return false;
+bool strong_probable_prime(const Montgomery&mont,std::uint64_t a,std::uint64_t d,unsigned r) {
+    std::uint64_t minus_one=mont.n-mont.one;
+    std::uint64_t base=mont.to_form(a);
+    if(base==0) {
+        return true;
+    }
+    std::uint64_t x=mont.one;
+    for(std::uint64_t e=d;;) {
+        if(e&1ULL) {
+            x=mont.mul(x,base);
+        }
+        e>>=1U;
+        if(e==0) {
+            break;
+        }
+        base=mont.mul(base,base);
+    }
+    if(x==mont.one||x==minus_one) {
+        return true;
     }
     for(unsigned i=1;i<r;++i) {
-        x=static_cast<std::uint64_t>(mul_mod(x,x,n));
-        if(x==n-1) {
-            return false;
+        x=mont.mul(x,x);
+        if(x==minus_one) {
+            return true;
         }
     }
-    return true;
+    return false;
 }
+
 }
 
 bool miller_rabin_is_prime(std::uint64_t n) {
-    if(n<2) {
-        return false;
+    TrialVerdict verdict=trial_division(n);
+    if(verdict!=TrialVerdict::Undecided) {
+        return verdict==TrialVerdict::Prime;
     }
-    static constexpr std::array<std::uint64_t,12>bases{
-        2,3,5,7,11,13,17,19,23,29,31,37};
-    for(std::uint64_t p : {2ULL,3ULL,5ULL,7ULL,11ULL,13ULL,17ULL,19ULL,23ULL,29ULL,31ULL,37ULL}) {
-        if(n==p) {
-            return true;
+    std::uint64_t d=n-1;
+    unsigned r=static_cast<unsigned>(std::countr_zero(d));
+    d>>=r;
+    Montgomery mont(n);
+    if(n<(1ULL<<32)) {
+        for(std::uint64_t a : kBases32) {
+            if(!strong_probable_prime(mont,a,d,r)) {
+                return false;
+            }
         }
-        if(n%p==0) {
+        return true;
+    }
+    for(std::uint64_t a : kBases64) {
+        if(!strong_probable_prime(mont,a,d,r)) {
             return false;
         }
     }
-    std::uint64_t d=n-1;
-    unsigned r=0;
-    while((d&1ULL)==0) {
-        d>>=1ULL;
-        ++r;
+    return true;
+}
+
+namespace {
+
+constexpr std::size_t kBatchBlock=4096;
+
+// Candidates of one block that passed trial division and share a base set;
+// index is the offset within the block.
+struct BatchLanes {
+    std::vector<std::uint64_t>n;
+    std::vector<std::uint64_t>one;
+    std::vector<std::uint32_t>index;
+    std::vector<Montgomery>mont;
+    std::vector<std::uint64_t>bases;
+    std::vector<std::uint8_t>pass;
+
+    void clear() {
+        n.clear();
+        one.clear();
+        index.clear();
+        mont.clear();
     }
-    for(std::uint64_t a : bases) {
-        if(a%n==0) {
-            continue;
+};
+
+// Runs every base over the lanes, dropping a lane as soon as a base proves
+// it composite. Base 2 goes first and uses the kernel's doubling step; it
+// rejects nearly every composite, so the setup the other bases need runs
+// mostly on primes.
+template<std::size_t N>
+void run_bases(const KernelTable&kernels,BatchLanes&lanes,const std::array<std::uint64_t,N>&bases,std::uint8_t*out) {
+    for(std::size_t b=0;b<N&&!lanes.n.empty();++b) {
+        std::size_t count=lanes.n.size();
+        lanes.pass.resize(count);
+        const std::uint64_t*forms=nullptr;
+        if(bases[b]!=2) {
+            if(lanes.mont.empty()) {
+                lanes.mont.reserve(count);
+                for(std::uint64_t n : lanes.n) {
+                    lanes.mont.emplace_back(n);
+                }
+            }
+            lanes.bases.resize(count);
+            for(std::size_t k=0;k<count;++k) {
+                lanes.bases[k]=lanes.mont[k].to_form(bases[b]);
+            }
+            forms=lanes.bases.data();
         }
-        if(check_composite(n,a,d,r)) {
-            return false;
+        kernels.strong_probable_primes(lanes.n.data(),lanes.one.data(),forms,count,lanes.pass.data());
+        std::size_t kept=0;
+        for(std::size_t k=0;k<count;++k) {
+            if(lanes.pass[k]) {
+                lanes.n[kept]=lanes.n[k];
+                lanes.one[kept]=lanes.one[k];
+                lanes.index[kept]=lanes.index[k];
+                if(!lanes.mont.empty()) {
+                    lanes.mont[kept]=lanes.mont[k];
+                }
+                ++kept;
+            } else {
+                out[lanes.index[k]]=0;
+            }
+        }
+        lanes.n.resize(kept);
+        lanes.one.resize(kept);
+        lanes.index.resize(kept);
+        if(!lanes.mont.empty()) {
+            lanes.mont.resize(kept,lanes.mont[0]);
         }
     }
-    return true;
+    for(std::uint32_t i : lanes.index) {
+        out[i]=1;
+    }
+}
+
+}
+
+void is_prime_batch(const std::uint64_t*values,std::size_t count,std::uint8_t*out,unsigned threads) {
+    if(count==0) {
+        return;
+    }
+    if(threads==0) {
+        threads=std::thread::hardware_concurrency();
+    }
+    std::size_t block_count=(count+kBatchBlock-1)/kBatchBlock;
+    threads=static_cast<unsigned>(std::clamp<std::size_t>(threads,1,block_count));
+    const KernelTable&kernels=active_kernels();
+    std::atomic<std::size_t>next_block{0};
+    auto work=[&]() {
+        BatchLanes small;
+        BatchLanes large;
+        for(std::size_t block=next_block.fetch_add(1);block<block_count;block=next_block.fetch_add(1)) {
+            std::size_t begin=block*kBatchBlock;
+            std::size_t end=std::min(count,begin+kBatchBlock);
+            small.clear();
+            large.clear();
+            for(std::size_t i=begin;i<end;++i) {
+                std::uint64_t n=values[i];
+                TrialVerdict verdict=trial_division(n);
+                if(verdict!=TrialVerdict::Undecided) {
+                    out[i]=verdict==TrialVerdict::Prime?1:0;
+                    continue;
+                }
+                BatchLanes&lanes=n<(1ULL<<32)?small:large;
+                lanes.n.push_back(n);
+                lanes.one.push_back((0-n)%n);
+                lanes.index.push_back(static_cast<std::uint32_t>(i-begin));
+            }
+            run_bases(kernels,small,kBases32,out+begin);
+            run_bases(kernels,large,kBases64,out+begin);
+        }
+    };
+    std::vector<std::thread>pool;
+    for(unsigned t=1;t<threads;++t) {
+        pool.emplace_back(work);
+    }
+    work();
+    for(auto&thread : pool) {
+        thread.join();
+    }
 }
 
 }
@@ -0,0 +1,198 @@
+#include "prime_search.h"
+
+#include "base_sieve.h"
+#include "divider.h"
+#include "prime_count.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace calcprime {
+namespace {
+
+constexpr std::uint64_t kWindowPrimeLimit=1024;
+// 1031 is the first prime past the table, so below its square a window
+// survivor is prime without further testing.
+constexpr std::uint64_t kExactLimit=1031ULL*1031ULL;
+constexpr std::uint64_t kLargestPrime=18446744073709551557ULL;
+constexpr std::uint64_t kLargestOdd=0xFFFFFFFFFFFFFFFFULL;
+constexpr std::size_t kMaxWindowOdds=1<<16;
+
+struct WindowPrime {
+    std::uint64_t prime;
+    FastDivider divider;
+};
+
+// Odd primes of the window sieve with their dividers, built once per
+// process so a query starts without a single hardware division.
+const std::vector<WindowPrime>&window_primes() {
+    static const std::vector<WindowPrime>table=[] {
+        std::vector<WindowPrime>primes;
+        for(std::uint32_t p : simple_sieve(kWindowPrimeLimit)) {
+            if(p>2) {
+                primes.push_back(WindowPrime{p,FastDivider(p)});
+            }
+        }
+        return primes;
+    }();
+    return table;
+}
+
+// Marks composite[i] for the odd numbers lo+2i, i<count, with a factor in
+// the window table; lo is odd and lo+2*(count-1) fits in 64 bits.
+void sieve_window(std::uint64_t lo,std::size_t count,std::vector<std::uint8_t>&composite) {
+    composite.assign(count,0);
+    std::uint64_t hi=lo+2*(count-1);
+    for(const WindowPrime&entry : window_primes()) {
+        std::uint64_t p=entry.prime;
+        if(p*p>hi) {
+            break;
+        }
+        std::uint64_t offset=0;
+        if(lo<=p*p) {
+            offset=p*p-lo;
+        } else {
+            std::uint64_t r=entry.divider.remainder(lo);
+            offset=r?p-r:0;
+        }
+        // Only odd multiples sit in the window.
+        if(offset&1ULL) {
+            offset+=p;
+        }
+        for(std::uint64_t i=offset/2;i<count;i+=p) {
+            composite[static_cast<std::size_t>(i)]=1;
+        }
+    }
+}
+
+// Odd numbers in the first window: a few expected gaps, since survivors are
+// confirmed lazily and a window that misses costs a second sieve.
+std::size_t initial_window_odds(std::uint64_t n) {
+    double gap=std::log(static_cast<double>(n)+2.0);
+    return std::max<std::size_t>(16,static_cast<std::size_t>(2.0*gap));
+}
+
+// Primes from start in one direction, start included, one window at a time.
+class PrimeWalker {
+public:
+    PrimeWalker(std::uint64_t start,bool forward)
+        : forward_(forward),window_odds_(initial_window_odds(start)) {
+        if(forward) {
+            pending_two_=start<=2;
+            next_odd_=start<=3?3:(start|1ULL);
+            exhausted_=start>kLargestPrime;
+        } else {
+            pending_two_=start>=2;
+            next_odd_=(start&1ULL)?start:start-1;
+            exhausted_=start<3;
+        }
+    }
+
+    // The next prime of the walk, or 0 once it passes 2 or 2^64.
+    std::uint64_t next() {
+        if(forward_&&pending_two_) {
+            pending_two_=false;
+            return 2;
+        }
+        for(;;) {
+            while(remaining_>0) {
+                --remaining_;
+                std::size_t i=forward_?count_-1-remaining_:remaining_;
+                if(composite_[i]) {
+                    continue;
+                }
+                std::uint64_t value=lo_+2*static_cast<std::uint64_t>(i);
+                if(exact_||miller_rabin_is_prime(value)) {
+                    return value;
+                }
+            }
+            if(!load_window()) {
+                if(!forward_&&pending_two_) {
+                    pending_two_=false;
+                    return 2;
+                }
+                return 0;
+            }
+        }
+    }
+
+private:
+    bool load_window() {
+        if(exhausted_) {
+            return false;
+        }
+        std::uint64_t odds_left=forward_?(kLargestOdd-next_odd_)/2+1:(next_odd_-3)/2+1;
+        std::size_t count=static_cast<std::size_t>(std::min<std::uint64_t>(window_odds_,odds_left));
+        exhausted_=count==odds_left;
+        if(forward_) {
+            lo_=next_odd_;
+            next_odd_=lo_+2*count;
+        } else {
+            lo_=next_odd_-2*(count-1);
+            next_odd_=lo_-2;
+        }
+        count_=count;
+        remaining_=count;
+        exact_=lo_+2*(count-1)<kExactLimit;
+        sieve_window(lo_,count,composite_);
+        window_odds_=std::min(window_odds_*2,kMaxWindowOdds);
+        return true;
+    }
+
+    bool forward_;
+    bool pending_two_=false;
+    bool exhausted_=false;
+    bool exact_=false;
+    std::uint64_t next_odd_=0;
+    std::uint64_t lo_=0;
+    std::size_t count_=0;
+    std::size_t remaining_=0;
+    std::size_t window_odds_;
+    std::vector<std::uint8_t>composite_;
+};
+
+}
+
+std::uint64_t next_prime(std::uint64_t n) {
+    if(n>=kLargestPrime) {
+        return 0;
+    }
+    return PrimeWalker(n+1,true).next();
+}
+
+std::uint64_t prev_prime(std::uint64_t n) {
+    if(n<=2) {
+        return 0;
+    }
+    return PrimeWalker(n-1,false).next();
+}
+
+std::vector<std::uint64_t>primes_around(std::uint64_t n,std::size_t k) {
+    std::vector<std::uint64_t>primes;
+    if(k==0) {
+        return primes;
+    }
+    if(n>2) {
+        PrimeWalker below(n-1,false);
+        for(std::size_t i=0;i<k;++i) {
+            std::uint64_t p=below.next();
+            if(p==0) {
+                break;
+            }
+            primes.push_back(p);
+        }
+        std::reverse(primes.begin(),primes.end());
+    }
+    PrimeWalker above(n,true);
+    for(std::size_t i=0;i<k;++i) {
+        std::uint64_t p=above.next();
+        if(p==0) {
+            break;
+        }
+        primes.push_back(p);
+    }
+    return primes;
+}
+
+}
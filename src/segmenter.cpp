@@ -7,6 +7,10 @@
 namespace calcprime {
 namespace {
 
+// Bucket entries keep a 29-bit position inside the segment, which covers
+// 2^29 bits of the odd-only layout.
+constexpr std::size_t kMaxSegmentBytes=std::size_t{1}<<26;
+
 std::size_t align_to(std::size_t value,std::size_t alignment) {
     if(alignment==0) {
         return value;
@@ -44,7 +48,7 @@ std::size_t clamp_floor_to_size_t(long double value) {
 
 }
 
-SegmentConfig choose_segment_config(const CpuInfo&info,unsigned threads,std::size_t requested_segment_bytes,std::size_t requested_tile_bytes,std::uint64_t range_length) {
+SegmentConfig choose_segment_config(const CpuInfo&info,unsigned threads,std::size_t requested_segment_bytes,std::size_t requested_tile_bytes,std::uint64_t range_length,SieveLayout layout) {
     std::size_t l1=info.l1_data_bytes ? info.l1_data_bytes : 32*1024;
     std::size_t l2=info.l2_bytes ? info.l2_bytes : 1024*1024;
 
@@ -74,6 +78,10 @@ SegmentConfig choose_segment_config(const CpuInfo&info,unsigned threads,std::siz
         constexpr long double min_segment=8.0L*1024.0L;
 
         long double R=static_cast<long double>(range_length);
+        if(layout==SieveLayout::Mod30Bytes) {
+            // The model is tuned for 16 numbers per byte; a mod-30 byte holds 30.
+            R=R*16.0L/30.0L;
+        }
         long double s_fixed=0.0L;
         if(R>0.0L) {
             long double scaled_R=R/1.0e10L;
@@ -143,6 +151,7 @@ SegmentConfig choose_segment_config(const CpuInfo&info,unsigned threads,std::siz
     if(segment_bytes<8*1024) {
         segment_bytes=8*1024;
     }
+    segment_bytes=std::min(segment_bytes,kMaxSegmentBytes);
 
     std::size_t tile_bytes=requested_tile_bytes;
     if(!tile_bytes) {
@@ -158,18 +167,64 @@ SegmentConfig choose_segment_config(const CpuInfo&info,unsigned threads,std::siz
     config.tile_bytes=tile_bytes;
     config.segment_bits=segment_bytes*8;
     config.tile_bits=tile_bytes*8;
-    config.segment_span=static_cast<std::uint64_t>(config.segment_bits)*2ULL;
-    config.tile_span=static_cast<std::uint64_t>(config.tile_bits)*2ULL;
+    config.layout=layout;
+    if(layout==SieveLayout::Mod30Bytes) {
+        config.segment_span=static_cast<std::uint64_t>(segment_bytes)*30ULL;
+        config.tile_span=static_cast<std::uint64_t>(tile_bytes)*30ULL;
+    } else {
+        config.segment_span=static_cast<std::uint64_t>(config.segment_bits)*2ULL;
+        config.tile_span=static_cast<std::uint64_t>(config.tile_bits)*2ULL;
+    }
     return config;
 }
 
-SegmentWorkQueue::SegmentWorkQueue(SieveRange range,const SegmentConfig&config)
-    : range_(range),config_(config),next_segment_(0) {
+std::uint64_t segment_origin(std::uint64_t range_begin,const SegmentConfig&config) {
+    if(config.layout==SieveLayout::Mod30Bytes) {
+        return range_begin-range_begin%30;
+    }
+    return range_begin;
+}
+
+SegmentWorkQueue::SegmentWorkQueue(SieveRange range,const SegmentConfig&config,SegmentSchedule schedule,std::size_t thread_count)
+    : range_(range),config_(config),schedule_(schedule),next_segment_(0) {
+    range_.begin=segment_origin(range_.begin,config_);
     length_=(range_.end>range_.begin)?(range_.end-range_.begin):0;
+    if(schedule_==SegmentSchedule::Contiguous) {
+        std::size_t blocks=thread_count?thread_count:1;
+        std::uint64_t count=segment_count();
+        block_begin_.resize(blocks+1);
+        for(std::size_t t=0;t<=blocks;++t) {
+            block_begin_[t]=count/blocks*t+std::min<std::uint64_t>(t,count%blocks);
+        }
+        block_next_.assign(block_begin_.begin(),block_begin_.end()-1);
+    }
 }
 
-bool SegmentWorkQueue::next(std::uint64_t&segment_id,std::uint64_t&segment_low,std::uint64_t&segment_high) {
-    std::uint64_t idx=next_segment_.fetch_add(1,std::memory_order_relaxed);
+std::uint64_t SegmentWorkQueue::first_segment(std::size_t thread_index) const {
+    if(schedule_==SegmentSchedule::Contiguous&&thread_index<block_next_.size()) {
+        return block_begin_[thread_index];
+    }
+    return 0;
+}
+
+std::size_t SegmentWorkQueue::segment_count() const {
+    if(config_.segment_span==0) {
+        return 0;
+    }
+    return static_cast<std::size_t>((length_+config_.segment_span-1)/config_.segment_span);
+}
+
+bool SegmentWorkQueue::next(std::size_t thread_index,std::uint64_t&segment_id,std::uint64_t&segment_low,std::uint64_t&segment_high) {
+    std::uint64_t idx=0;
+    if(schedule_==SegmentSchedule::Contiguous) {
+        // Each block is only ever read and advanced by its own thread.
+        if(thread_index>=block_next_.size()||block_next_[thread_index]>=block_begin_[thread_index+1]) {
+            return false;
+        }
+        idx=block_next_[thread_index]++;
+    } else {
+        idx=next_segment_.fetch_add(1,std::memory_order_relaxed);
+    }
     std::uint64_t span=config_.segment_span;
     std::uint64_t offset=idx*span;
     if(span!=0&&offset/span!=idx) {
@@ -1,12 +1,44 @@
 #include "wheel.h"
 
+#include "kernels.h"
+
 #include <algorithm>
 #include <bit>
+#include <cstring>
 #include <numeric>
 
 namespace calcprime {
 namespace {
 
+// The presieve table absorbs every odd prime up to this bound, whatever the
+// wheel; 3*5*7*11*13*17*19 odd values fit in ~600 KB of bits. Adding 23
+// would push the table to ~14 MB, far outside L2.
+constexpr std::uint32_t kPresievePrimes[]={3,5,7,11,13,17,19};
+
+PackedPresieve build_packed_presieve() {
+    PackedPresieve presieve;
+    std::uint64_t period=1;
+    for(std::uint32_t prime : kPresievePrimes) {
+        if(30%prime==0) {
+            continue;
+        }
+        presieve.primes.push_back(prime);
+        period*=prime;
+    }
+    presieve.period=static_cast<std::uint32_t>(period);
+    presieve.pattern.assign(static_cast<std::size_t>(period),0);
+    std::uint64_t limit=period*30;
+    for(std::uint32_t prime : presieve.primes) {
+        for(std::uint64_t value=prime;value<limit;value+=2ULL*prime) {
+            std::uint8_t bit=kWheel30BitIndex[value%30];
+            if(bit!=0xFF) {
+                presieve.pattern[value/30]|=static_cast<std::uint8_t>(1u<<bit);
+            }
+        }
+    }
+    return presieve;
+}
+
 SmallPrimePattern build_small_pattern(std::uint32_t prime) {
     SmallPrimePattern pattern{};
     pattern.prime=prime;
@@ -16,17 +48,6 @@ SmallPrimePattern build_small_pattern(std::uint32_t prime) {
     std::uint32_t word_stride=static_cast<std::uint32_t>(128%prime);
     pattern.word_stride=word_stride;
     std::uint32_t inv2=(prime+1)/2;
-    for(std::size_t bit=0;bit<pattern.start_phase.size();++bit) {
-        std::uint32_t twice=static_cast<std::uint32_t>(bit<<1);
-        while(twice>=prime) {
-            twice-=prime;
-        }
-        std::uint32_t phase=(prime-twice);
-        if(phase==prime) {
-            phase=0;
-        }
-        pattern.start_phase[bit]=static_cast<std::uint8_t>(phase);
-    }
     for(std::uint32_t residue=0;residue<prime;++residue) {
         std::uint64_t mask=0;
         std::uint32_t offset=static_cast<std::uint32_t>(((prime-residue)%prime)*static_cast<std::uint64_t>(inv2)%prime);
@@ -37,9 +58,36 @@ SmallPrimePattern build_small_pattern(std::uint32_t prime) {
         pattern.masks[residue]=mask;
         pattern.next_phase[residue]=static_cast<std::uint32_t>((residue+word_stride)%prime);
     }
+    pattern.stream.resize(prime+kSmallStreamPad);
+    pattern.stream_index.resize(prime);
+    std::uint32_t phase=0;
+    for(std::uint32_t j=0;j<prime+kSmallStreamPad;++j) {
+        pattern.stream[j]=pattern.masks[phase];
+        if(j<prime) {
+            pattern.stream_index[phase]=static_cast<std::uint8_t>(j);
+        }
+        phase=pattern.next_phase[phase];
+    }
     return pattern;
 }
 
+void build_presieve_pattern(Wheel&wheel) {
+    // One period plus two spare words, so a shifted read that starts anywhere
+    // in the period can run up to 64 bits past its end. Word w begins at the
+    // odd value 128*w+1; every covered prime divides 2*period, so the tail
+    // words continue the period seamlessly.
+    std::size_t words=(static_cast<std::size_t>(wheel.presieve_period)+63)/64+2;
+    wheel.presieve_pattern.assign(words,0);
+    for(std::uint32_t prime : wheel.presieve_primes) {
+        SmallPrimePattern pattern=build_small_pattern(prime);
+        std::uint32_t phase=1%prime;
+        for(std::size_t w=0;w<words;++w) {
+            wheel.presieve_pattern[w]|=pattern.masks[phase];
+            phase=pattern.next_phase[phase];
+        }
+    }
+}
+
 Wheel build_wheel(std::uint32_t modulus,WheelType type) {
     Wheel wheel;
     wheel.type=type;
@@ -65,62 +113,91 @@ Wheel build_wheel(std::uint32_t modulus,WheelType type) {
         }
     }
 
-    static const std::uint32_t kSmallPrimes[]={3,5,7,11,13,17,19,
-                                                 23,29,31,37,41,43,47};
-    std::uint32_t small_limit=29u;
-    switch(type) {
-    case WheelType::Mod30:
-        small_limit=29u;
-        break;
-    case WheelType::Mod210:
-        small_limit=47u;
-        break;
-    case WheelType::Mod1155:
-        small_limit=47u;
-        break;
+    std::uint64_t period=1;
+    for(std::uint32_t prime : kPresievePrimes) {
+        wheel.presieve_primes.push_back(prime);
+        period*=prime;
     }
+    wheel.presieve_period=static_cast<std::uint32_t>(period);
+
+    // Primes above the presieve and up to ~100 are ORed in as whole-word
+    // pattern streams; beyond that a prime hits too few bits per word.
+    static const std::uint32_t kSmallPrimes[]={3,5,7,11,13,17,19,
+                                                 23,29,31,37,41,43,47,53,59,61,
+                                                 67,71,73,79,83,89,97};
+    wheel.small_prime_limit=97u;
     for(std::uint32_t prime : kSmallPrimes) {
-        if(prime>small_limit) {
+        if(prime>wheel.small_prime_limit) {
             break;
         }
+        if(prime<=wheel.presieve_primes.back()) {
+            continue;
+        }
         wheel.small_patterns.push_back(build_small_pattern(prime));
     }
+    build_presieve_pattern(wheel);
     return wheel;
 }
 
 }
 
 const Wheel&get_wheel(WheelType type) {
-    static const Wheel wheel30=build_wheel(30,WheelType::Mod30);
-    static const Wheel wheel210=build_wheel(210,WheelType::Mod210);
-    static const Wheel wheel1155=build_wheel(1155,WheelType::Mod1155);
     switch(type) {
     case WheelType::Mod30:
-        return wheel30;
-    case WheelType::Mod210:
+        break;
+    case WheelType::Mod210: {
+        static const Wheel wheel210=build_wheel(210,WheelType::Mod210);
         return wheel210;
-    case WheelType::Mod1155:
+    }
+    case WheelType::Mod1155: {
+        static const Wheel wheel1155=build_wheel(1155,WheelType::Mod1155);
         return wheel1155;
     }
+    }
+    static const Wheel wheel30=build_wheel(30,WheelType::Mod30);
     return wheel30;
 }
 
-void Wheel::apply_presieve(std::uint64_t start_value,std::size_t bit_count,std::uint64_t*bits) const {
-    if(allowed.empty()) {
-        return;
-    }
-    std::uint32_t rem=static_cast<std::uint32_t>(start_value%modulus);
-    for(std::size_t idx=0;idx<bit_count;++idx) {
-        if(!allowed[rem]) {
-            std::size_t word=idx/64;
-            std::size_t bit=idx%64;
-            bits[word]|=(1ULL<<bit);
+const PackedPresieve&get_packed_presieve() {
+    static const PackedPresieve presieve=build_packed_presieve();
+    return presieve;
+}
+
+void Wheel::fill_presieve(std::uint64_t start_value,std::size_t bit_count,std::uint64_t*bits) const {
+    std::size_t word_count=(bit_count+63)/64;
+    // Bit k of the table stands for the odd value 2k+1, so the segment is a
+    // window of the table starting at bit (start_value>>1) mod period. Copy
+    // it in runs that stay within one period plus the spare tail words.
+    std::uint64_t pos=(start_value>>1)%presieve_period;
+    std::size_t filled=0;
+    while(filled<word_count) {
+        std::size_t run=static_cast<std::size_t>((presieve_period+64-pos)/64);
+        run=std::min(run,word_count-filled);
+        const std::uint64_t*src=presieve_pattern.data()+pos/64;
+        unsigned shift=static_cast<unsigned>(pos%64);
+        if(shift==0) {
+            std::memcpy(bits+filled,src,run*sizeof(std::uint64_t));
+        } else {
+            active_kernels().shift_copy(bits+filled,src,run,shift);
         }
-        rem+=2;
-        if(rem>=modulus) {
-            rem-=modulus;
+        filled+=run;
+        pos+=static_cast<std::uint64_t>(run)*64;
+        if(pos>=presieve_period) {
+            pos-=presieve_period;
         }
     }
 }
 
+void PackedPresieve::fill(std::uint64_t start_byte,std::size_t byte_count,std::uint8_t*bytes) const {
+    // The period is a whole number of bytes, so the window is plain copies.
+    std::size_t pos=static_cast<std::size_t>(start_byte%period);
+    std::size_t filled=0;
+    while(filled<byte_count) {
+        std::size_t run=std::min<std::size_t>(period-pos,byte_count-filled);
+        std::memcpy(bytes+filled,pattern.data()+pos,run);
+        filled+=run;
+        pos=0;
+    }
+}
+
 }